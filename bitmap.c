@@ -22,17 +22,29 @@
  */
 #include <linux/buffer_head.h>
 #include <linux/bitops.h>
+#include <linux/bitmap.h>
+#include <linux/math64.h>
 #include <linux/sched.h>
+#include <linux/slab.h>
+#include <linux/smp.h>
+#include <linux/vmalloc.h>
 #include "wufs.h"
 
 /**
  * Exported routines.
  */
-unsigned long      wufs_count_free_blocks(struct wufs_sb_info *sbi);
-unsigned long      wufs_count_free_inodes(struct wufs_sb_info *sbi);
+unsigned long      wufs_count_free_blocks(struct super_block *sb);
+unsigned long      wufs_count_free_inodes(struct super_block *sb);
 void               wufs_free_block(struct inode *inode, unsigned long block);
+void               wufs_free_blocks(struct inode *inode, unsigned long block,
+				    unsigned long count);
 void               wufs_free_inode(struct inode * inode);
-int                wufs_new_block(struct inode * inode);
+int                wufs_setup_groups(struct super_block *sb);
+void               wufs_destroy_groups(struct wufs_sb_info *sbi);
+unsigned long      wufs_new_block(struct inode * inode, unsigned long goal);
+unsigned long      wufs_new_blocks(struct inode *inode, unsigned long goal,
+				   unsigned long minlen, unsigned long maxlen,
+				   unsigned long *count);
 struct inode      *wufs_new_inode(const struct inode * dir, int * error);
 struct wufs_inode *wufs_raw_inode(struct super_block *sb, ino_t ino,
 				     struct buffer_head **bh);
@@ -40,156 +52,470 @@ struct wufs_inode *wufs_raw_inode(struct super_block *sb, ino_t ino,
 /*
  * Local routines
  */
-static unsigned long count_free(struct buffer_head **map,unsigned numblocks);
+static void          free_groups(struct wufs_group_info *gi);
+static void          count_group(struct wufs_sb_info *sbi, unsigned long g,
+				 struct buffer_head *bh, int bits_per_block);
+static void          census_step(struct super_block *sb);
+static unsigned long count_free(struct buffer_head *bh,
+				unsigned long from, unsigned long to);
+static int           find_zero_run(const unsigned long *map,
+				   unsigned long from, unsigned long to,
+				   unsigned long minlen, unsigned long maxlen,
+				   unsigned long *start, unsigned long *len);
+static inline void   group_bounds(struct wufs_sb_info *sbi, unsigned long g,
+				  int bits_per_block,
+				  unsigned long *lo, unsigned long *hi);
+static inline void   igroup_bounds(struct wufs_sb_info *sbi, unsigned long g,
+				   unsigned long *lo, unsigned long *hi);
+static inline unsigned long imap_bits(struct wufs_sb_info *sbi,
+				      unsigned long i, int bits_per_block);
+static struct buffer_head *read_bitmap(struct super_block *sb,
+				       unsigned long start, unsigned long i);
+static int           setup_igroups(struct super_block *sb);
 static void          wufs_clear_inode(struct inode *inode);
 
 /*
  * Note:
+ * The block bitmap is split into allocation groups, one per bitmap block,
+ * each with its own lock, free count, and rotor (see wufs_group_info in
+ * wufs.h).  An allocation without a goal starts in the group of the
+ * current cpu, and moves on to neighboring groups only when that one is
+ * full, so parallel writers tend to work in different groups.  The inode
+ * bitmap is split the same way, into groups of WUFS_IGROUP_BITS inodes
+ * (several to a map block, so even small volumes have many).  All these
+ * locks are per-mount, so allocation on one volume never waits on another.
+ * Bitmap blocks are read on demand (see read_bitmap), and the group free
+ * counts are taken lazily, so mounting reads no block bitmap at all.
  * External bit operations used in this module are described in
  *  <linux-kernel-distro/Documentation/atomic_ops.txt>
  * In particular, all __x routines are non-atomic variants of x, typically
  * depending on more general locking strategies.
  */
 
-/*
- * Global structures.
+/**
+ * wufs_setup_groups: (utility function)
+ * Build the allocation group tables at mount time.  No block bitmap block
+ * is read here: each group takes a census of its bitmap block when the allocator
+ * first touches it (or steps past it, see census_step); afterwards the
+ * allocator keeps these counts (and their total, sbi_free_blocks) current.
+ * Returns 0, -ENOMEM, or -EIO (see setup_igroups).
+ */
+int wufs_setup_groups(struct super_block *sb)
+{
+  struct wufs_sb_info *sbi = wufs_sb(sb);
+  int bits_per_block = 8 * sb->s_blocksize;
+  struct wufs_group_info *gi;
+  unsigned long g, lo, hi, uncounted = 0, size;
+  int err;
+
+  /* (large volumes have more groups than kmalloc comfortably provides) */
+  size = sbi->sbi_bmap_bcnt * sizeof(struct wufs_group_info);
+  gi = (size <= PAGE_SIZE) ? kmalloc(size, GFP_KERNEL) : vmalloc(size);
+  if (!gi) return -ENOMEM;
+  memset(gi, 0, size);
+
+  for (g = 0; g < sbi->sbi_bmap_bcnt; g++) {
+    spin_lock_init(&gi[g].gri_lock);
+    /* searches begin at the first data block of the group */
+    group_bounds(sbi, g, bits_per_block, &lo, &hi);
+    gi[g].gri_rotor = lo;
+    /* groups that hold only metadata have nothing to count */
+    gi[g].gri_counted = (lo >= hi);
+    if (!gi[g].gri_counted) uncounted++;
+  }
+
+  if (percpu_counter_init(&sbi->sbi_free_blocks, 0)) {
+    free_groups(gi);
+    return -ENOMEM;
+  }
+  atomic_set(&sbi->sbi_uncounted, uncounted);
+  sbi->sbi_groups = gi;
+
+  /* (inode groups, on the other hand, are counted now) */
+  err = setup_igroups(sb);
+  if (err) {
+    percpu_counter_destroy(&sbi->sbi_free_blocks);
+    free_groups(gi);
+    sbi->sbi_groups = NULL;
+  }
+  return err;
+}
+
+/**
+ * setup_igroups: (utility function)
+ * Build the inode allocation group table at mount time, counting the free
+ * inodes of each group (streaming the inode map).  From here on, the
+ * allocator keeps these counts (and their total, sbi_free_inodes) current.
+ * Returns 0, -ENOMEM, or -EIO if the inode map could not be read.
+ */
+static int setup_igroups(struct super_block *sb)
+{
+  struct wufs_sb_info *sbi = wufs_sb(sb);
+  int bits_per_block = 8 * sb->s_blocksize;
+  unsigned long ngroups = (sbi->sbi_inodes + WUFS_IGROUP_BITS - 1) / WUFS_IGROUP_BITS;
+  struct wufs_group_info *gi;
+  struct buffer_head *bh;
+  unsigned long i, g, from, nbits, size;
+
+  size = ngroups * sizeof(struct wufs_group_info);
+  gi = (size <= PAGE_SIZE) ? kmalloc(size, GFP_KERNEL) : vmalloc(size);
+  if (!gi) return -ENOMEM;
+  memset(gi, 0, size);
+  for (g = 0; g < ngroups; g++) {
+    spin_lock_init(&gi[g].gri_lock);
+    gi[g].gri_rotor = g * WUFS_IGROUP_BITS;
+    gi[g].gri_counted = 1;
+  }
+  if (percpu_counter_init(&sbi->sbi_free_inodes, 0)) {
+    free_groups(gi);
+    return -ENOMEM;
+  }
+
+  for (i = 0; i < sbi->sbi_imap_bcnt; i++) {
+    /* the number of inodes described by imap block i */
+    nbits = imap_bits(sbi, i, bits_per_block);
+    if (!nbits) break;
+    bh = read_bitmap(sb, sbi->sbi_imap_start, i);
+    if (!bh) {
+      percpu_counter_destroy(&sbi->sbi_free_inodes);
+      free_groups(gi);
+      return -EIO;
+    }
+    for (from = 0; from < nbits; from += WUFS_IGROUP_BITS) {
+      g = (i * bits_per_block + from) / WUFS_IGROUP_BITS;
+      gi[g].gri_free = count_free(bh, from, min(from + WUFS_IGROUP_BITS, nbits));
+      percpu_counter_add(&sbi->sbi_free_inodes, gi[g].gri_free);
+    }
+    brelse(bh);
+  }
+  sbi->sbi_igroups = gi;
+  sbi->sbi_igroup_cnt = ngroups;
+  return 0;
+}
+
+/**
+ * wufs_destroy_groups: (utility function)
+ * Undo wufs_setup_groups.
+ */
+void wufs_destroy_groups(struct wufs_sb_info *sbi)
+{
+  if (!sbi->sbi_groups) return;
+  percpu_counter_destroy(&sbi->sbi_free_blocks);
+  free_groups(sbi->sbi_groups);
+  sbi->sbi_groups = NULL;
+  percpu_counter_destroy(&sbi->sbi_free_inodes);
+  free_groups(sbi->sbi_igroups);
+  sbi->sbi_igroups = NULL;
+}
+
+/**
+ * free_groups: (utility function)
+ * Free a group table allocated by wufs_setup_groups.
  */
+static void free_groups(struct wufs_group_info *gi)
+{
+  if (is_vmalloc_addr(gi)) vfree(gi);
+  else kfree(gi);
+}
+
+/**
+ * group_bounds: (utility function)
+ * Compute the range [lo, hi) of data block lbas held by group g.
+ * (The range is empty for groups that map only metadata.)
+ */
+static inline void group_bounds(struct wufs_sb_info *sbi, unsigned long g,
+				int bits_per_block,
+				unsigned long *lo, unsigned long *hi)
+{
+  *lo = max(g * bits_per_block, sbi->sbi_first_block);
+  *hi = min((g + 1) * bits_per_block, sbi->sbi_blocks);
+}
+
+/**
+ * igroup_bounds: (utility function)
+ * Compute the range [lo, hi) of inode indices held by inode group g.
+ */
+static inline void igroup_bounds(struct wufs_sb_info *sbi, unsigned long g,
+				 unsigned long *lo, unsigned long *hi)
+{
+  *lo = g * WUFS_IGROUP_BITS;
+  *hi = min(*lo + WUFS_IGROUP_BITS, sbi->sbi_inodes);
+}
 
 /**
- * ztab: (local table)
- * This structure returns the number of bits that are zero for each byte value.
+ * read_bitmap: (utility function)
+ * Read block i of the bitmap that begins at lba start.
+ * Bitmap blocks are not pinned for the life of the mount: they are read when
+ * first needed, and released after each use (later reads are usually
+ * buffer cache hits), so clean bitmap blocks may be evicted.
  */
-static const int ztab[] = {
-  /* 0x00-0x0f: */ 8,7,7,6,7,6,6,5,7,6,6,5,6,5,5,4,
-  /* 0x10-0x1f: */ 7,6,6,5,6,5,5,4,6,5,5,4,5,4,4,3,
-  /* 0x20-0x2f: */ 7,6,6,5,6,5,5,4,6,5,5,4,5,4,4,3,
-  /* 0x30-0x3f: */ 6,5,5,4,5,4,4,3,5,4,4,3,4,3,3,2,
-  /* 0x40-0x4f: */ 7,6,6,5,6,5,5,4,6,5,5,4,5,4,4,3,
-  /* 0x50-0x5f: */ 6,5,5,4,5,4,4,3,5,4,4,3,4,3,3,2,
-  /* 0x60-0x6f: */ 6,5,5,4,5,4,4,3,5,4,4,3,4,3,3,2,
-  /* 0x70-0x7f: */ 5,4,4,3,4,3,3,2,4,3,3,2,3,2,2,1,
-  /* 0x80-0x8f: */ 7,6,6,5,6,5,5,4,6,5,5,4,5,4,4,3,
-  /* 0x90-0x9f: */ 6,5,5,4,5,4,4,3,5,4,4,3,4,3,3,2,
-  /* 0xa0-0xaf: */ 6,5,5,4,5,4,4,3,5,4,4,3,4,3,3,2,
-  /* 0xb0-0xbf: */ 5,4,4,3,4,3,3,2,4,3,3,2,3,2,2,1,
-  /* 0xc0-0xcf: */ 6,5,5,4,5,4,4,3,5,4,4,3,4,3,3,2,
-  /* 0xd0-0xdf: */ 5,4,4,3,4,3,3,2,4,3,3,2,3,2,2,1,
-  /* 0xe0-0xef: */ 5,4,4,3,4,3,3,2,4,3,3,2,3,2,2,1,
-  /* 0xf0-0xff: */ 4,3,3,2,3,2,2,1,3,2,2,1,2,1,1,0,
-};
-
-/* ZEROS:
- * return the number of zeros in a byte
+static struct buffer_head *read_bitmap(struct super_block *sb,
+				       unsigned long start, unsigned long i)
+{
+  struct buffer_head *bh = sb_bread(sb, start + i);
+  if (!bh) printk("WUFS: unable to read bitmap block %lu on %s\n",
+		  start + i, sb->s_id);
+  return bh;
+}
+
+/**
+ * count_group: (utility function)
+ * Take the census of group g from its bitmap block, bh, on first use,
+ * and fold it into the total free block count.
+ * Caller must hold the group's lock.
  */
-inline int ZEROS(char x) { return ztab[(__u8)x]; }
+static void count_group(struct wufs_sb_info *sbi, unsigned long g,
+			struct buffer_head *bh, int bits_per_block)
+{
+  struct wufs_group_info *gi = sbi->sbi_groups + g;
+  unsigned long lo, hi;
+
+  /* count the free data blocks; bits past sbi_blocks are not blocks */
+  group_bounds(sbi, g, bits_per_block, &lo, &hi);
+  gi->gri_free = count_free(bh, lo - g * bits_per_block,
+			    hi - g * bits_per_block);
+  gi->gri_counted = 1;
+  percpu_counter_add(&sbi->sbi_free_blocks, gi->gri_free);
+  atomic_dec(&sbi->sbi_uncounted);
+}
 
 /**
- * bitmap_lock:
- * This lock is used to control short accesses to the bitmaps associated
- * with the WUFS filesystem.
- * This lock can cause a busy wait, with no preemption.
+ * census_step: (utility function)
+ * Take the census of the next group (from sbi_census on) that has none
+ * yet.  Each allocation call takes one step, so the free block total
+ * becomes exact over time without anyone waiting on a scan of the whole
+ * map.  (sbi_census is only a hint: racing callers may visit a group
+ * twice, which count_group's check makes harmless.)
  */
-static DEFINE_SPINLOCK(bitmap_lock);
+static void census_step(struct super_block *sb)
+{
+  struct wufs_sb_info *sbi = wufs_sb(sb);
+  int bits_per_block = 8 * sb->s_blocksize;
+  struct wufs_group_info *gi;
+  struct buffer_head *bh;
+  unsigned long g;
+
+  if (!atomic_read(&sbi->sbi_uncounted)) return;
+  for (g = sbi->sbi_census; g < sbi->sbi_bmap_bcnt; g++)
+    if (!sbi->sbi_groups[g].gri_counted) break;
+  if (g >= sbi->sbi_bmap_bcnt) return;
+  sbi->sbi_census = g + 1;
+
+  gi = sbi->sbi_groups + g;
+  bh = read_bitmap(sb, sbi->sbi_bmap_start, g);
+  if (!bh) return;
+  spin_lock(&gi->gri_lock);
+  if (!gi->gri_counted) count_group(sbi, g, bh, bits_per_block);
+  spin_unlock(&gi->gri_lock);
+  brelse(bh);
+}
 
 /**
  * wufs_count_free_blocks: (utility function)
- * Count the number of zeros in the block bitmap.
- * We start at bit zero.
+ * Return the number of free blocks on the file system, without reading
+ * the bitmap: the total maintained by the allocator for the groups counted
+ * so far, plus an estimate for the rest (assumed to be as full as the
+ * counted ones).  Once the census is complete (see census_step) the
+ * result is exact.
  */
-unsigned long wufs_count_free_blocks(struct wufs_sb_info *sbi)
+unsigned long wufs_count_free_blocks(struct super_block *sb)
 {
-  /* count the number of bits that are zero in the bmap */
-  return count_free(sbi->sbi_bmap, sbi->sbi_bmap_bcnt);
+  struct wufs_sb_info *sbi = wufs_sb(sb);
+  unsigned long bits_per_block = 8 * sb->s_blocksize;
+  unsigned long free = percpu_counter_sum_positive(&sbi->sbi_free_blocks);
+  unsigned long data = sbi->sbi_blocks - sbi->sbi_first_block;
+  unsigned long rest = atomic_read(&sbi->sbi_uncounted) * bits_per_block;
+
+  /* (group sizes are approximate: the first and last are partial) */
+  if (!rest) return free;
+  if (rest >= data) return data;
+  free += div64_u64((u64)rest * free, data - rest);
+  return min(free, data);
 }
 
 /**
  * wufs_count_free_inodes: (utility function)
- * Count the number of zeros in the inode bitmap.
- * We start at bit index 0 (corresponding to inode 1).
+ * Return the number of free inodes on the file system.
+ * The inode groups are counted at mount (see setup_igroups); after that
+ * this is simply the total maintained by the allocator.
  */
-unsigned long wufs_count_free_inodes(struct wufs_sb_info *sbi)
+unsigned long wufs_count_free_inodes(struct super_block *sb)
 {
-  return count_free(sbi->sbi_imap, sbi->sbi_imap_bcnt);
+  return percpu_counter_sum_positive(&wufs_sb(sb)->sbi_free_inodes);
+}
+
+/**
+ * imap_bits: (utility function)
+ * The number of inodes described by block i of the inode map.
+ */
+static inline unsigned long imap_bits(struct wufs_sb_info *sbi, unsigned long i,
+				      int bits_per_block)
+{
+  if (sbi->sbi_inodes <= i * bits_per_block) return 0;
+  return min(sbi->sbi_inodes - i * bits_per_block,
+	     (unsigned long)bits_per_block);
 }
 
 /**
  * count_free:
- * Counts the number of zero bits pointed to by a bitmap.
- * The structures that contain the bitmap are pointed to by map
- * but are (likely) not contiguous, so we have to chunk through
- * by blocks.
+ * Counts the number of zero bits in positions [from, to) of the bitmap
+ * held in buffer bh.
+ * The set bits are tallied a machine word at a time by the kernel's
+ * population count (bitmap_weight, built on hweight_long), starting with
+ * the word that holds bit from, so the cost is that of the range alone.
  */
-static unsigned long count_free(struct buffer_head **map,
-				unsigned numblocks)
+static unsigned long count_free(struct buffer_head *bh,
+				unsigned long from, unsigned long to)
 {
-  unsigned sum = 0, remaining;
-  struct buffer_head *bh;
-  __u8 *p;
+  const unsigned long *map;
+  unsigned long set;
 
-  /* 
-   * This code assumes that the bitmap takes up an even number of blocks.
-   */
-  while (numblocks--) {
-    /* sanity check: all map entries should be defined */
-    if (!(bh=*map++)) return 0;
-    p = bh->b_data;
-    remaining = bh->b_size;
-    /* for each buffer_head, scan through the bytes (chars) and count zeros */
-    while (remaining--) sum += ZEROS(*p++);
+  /* sanity check: all map entries should be defined */
+  if (!bh || from >= to) return 0;
+
+  /* re-base the range on the word holding from */
+  map = (const unsigned long *)bh->b_data + from / BITS_PER_LONG;
+  to -= from - from % BITS_PER_LONG;
+  from %= BITS_PER_LONG;
+
+  /* weigh [0, to), less the bits of the first word before from */
+  set = bitmap_weight(map, to);
+  if (from) set -= hweight_long(*map & ((1UL << from) - 1));
+  return (to - from) - set;
+}
+
+/**
+ * find_zero_run: (local utility)
+ * Find the lowest run of at least minlen (and at most maxlen) clear bits
+ * within bits [from, to) of the bitmap map.  Returns 1, with the offset of
+ * the run in *start and its length in *len, or 0 if there is none.
+ * Caller must hold the lock protecting map.
+ */
+static int find_zero_run(const unsigned long *map,
+			 unsigned long from, unsigned long to,
+			 unsigned long minlen, unsigned long maxlen,
+			 unsigned long *start, unsigned long *len)
+{
+  unsigned long j, end;
+
+  while (from < to) {
+    /* find the next free block, then the end of the free run (<= maxlen) */
+    j = find_next_zero_bit(map, to, from);
+    if (j >= to) break;
+    end = find_next_bit(map, min(to, j + maxlen), j);
+    if (end - j >= minlen) {
+      *start = j;
+      *len = end - j;
+      return 1;
+    }
+    /* run too short; continue beyond it */
+    from = end;
   }
-  return(sum);
+  return 0;
 }
 
-/** 
- * wufs_new_block: (utility function)
- * Allocate a new block on the disk.  Disk block numbering starts at 0,
- * but the first few blocks are always used to hold boot code, superblock,
- * etc.  We could, instead, start at first block.
+/**
+ * wufs_new_blocks: (utility function)
+ * Allocate a run of physically contiguous blocks: at least minlen, and as
+ * many as maxlen.  The whole run is found and claimed in one critical section
+ * and costs one bitmap buffer update.
+ * The caller may suggest a goal lba (typically the block just beyond the
+ * previous block of the file); the search begins there, so files grown
+ * sequentially end up physically contiguous.  With no (legal) goal, the
+ * search begins at the rotor (just beyond the last run handed out) of the
+ * current cpu's group.  Either way, the search wraps around within the
+ * group, and then moves on to the following groups.  Groups known to be too
+ * full are passed over without reading their bitmap blocks.  (Blocks before
+ * sbi_first_block hold boot code, superblock, etc., and are never
+ * considered.)
+ * Returns the lba of the first block, and the length of the run in *count,
+ * or 0 if no run of minlen blocks is free.
  */
-int wufs_new_block(struct inode * inode)
+unsigned long wufs_new_blocks(struct inode *inode, unsigned long goal,
+			      unsigned long minlen, unsigned long maxlen,
+			      unsigned long *count)
 {
   /* grab the superblock info.. */
-  struct wufs_sb_info *sbi = wufs_sb(inode->i_sb);
+  struct super_block *sb = inode->i_sb;
+  struct wufs_sb_info *sbi = wufs_sb(sb);
+  unsigned long ngroups = sbi->sbi_bmap_bcnt;
 
   /* determine how many bits of the bitmap are stored in each block */
-  int bits_per_block = 8 * inode->i_sb->s_blocksize;
-  int i;
-
-  /* zip through the block map blocks */
-  for (i = 0; i < sbi->sbi_bmap_bcnt; i++) {
-    struct buffer_head *bh = sbi->sbi_bmap[i];
-    int j;
-
-    /* get exclusive access to bitmap */
-    spin_lock(&bitmap_lock);
+  int bits_per_block = 8 * sb->s_blocksize;
+  struct wufs_group_info *gi;
+  struct buffer_head *bh = NULL;
+  unsigned long g, n, lo, hi, base, start, j, k, len = 0;
+  int found = 0;
+
+  *count = 0;
+  if (!minlen || minlen > maxlen) return 0;
+  census_step(sb);
+
+  /* pick the starting group: the goal's, or this cpu's own */
+  if (sbi->sbi_first_block <= goal && goal < sbi->sbi_blocks) {
+    g = goal / bits_per_block;
+  } else {
+    goal = 0;
+    g = raw_smp_processor_id() % ngroups;
+  }
 
-    /* returns the bit offset of the first zero bit, or just beyond if none */
-    j = find_first_zero_bit((unsigned long *)bh->b_data, bits_per_block);
-    if (j < bits_per_block) { /* found a free block */
+  for (n = 0; n < ngroups; n++, g = (g + 1) % ngroups, goal = 0) {
+    gi = sbi->sbi_groups + g;
+
+    /* quick (unlocked) check: skip groups known to be too full */
+    if (gi->gri_counted && gi->gri_free < minlen) continue;
+    group_bounds(sbi, g, bits_per_block, &lo, &hi);
+    if (lo >= hi) continue;
+
+    /* bring in the group's bitmap block */
+    bh = read_bitmap(sb, sbi->sbi_bmap_start, g);
+    if (!bh) continue;
+    base = g * bits_per_block;
+
+    /* get exclusive access to the group's bitmap (and its rotor) */
+    spin_lock(&gi->gri_lock);
+    if (!gi->gri_counted) count_group(sbi, g, bh, bits_per_block);
+    start = goal ? goal : gi->gri_rotor;
+    if (start < lo || start >= hi) start = lo;
+
+    /* search from the goal (or rotor) to the end of the group, then wrap */
+    found = find_zero_run((unsigned long *)bh->b_data, start - base, hi - base,
+			  minlen, maxlen, &j, &len) ||
+      find_zero_run((unsigned long *)bh->b_data, lo - base, start - base,
+		    minlen, maxlen, &j, &len);
+    if (found) {
       /* mark it allocated */
-      __set_bit(j, (unsigned long*)bh->b_data); /* see <linux/Documentation/atomic_ops.txt> */
-      spin_unlock(&bitmap_lock);
-
-      /* push the bitmap back to the disk */
-      mark_buffer_dirty(bh);
-
-      /*
-       * we now compute the actual bit offset from the beginning of the
-       * entire bitmap; ie. compute the LBA of the disk block.
-       * this should range from 0 <= j < sbi->sbi_blocks, *but* 
-       * we only use this routine to allocate blocks at or after 
-       * sbi->sbi_first_block, so 0 can be used to signal "not found".
-       */
-      j += i*bits_per_block;
-      if (sbi->sbi_first_block <= j && j < sbi->sbi_blocks) {
-	return j;
-      } else {
-	return 0;
-      }
+      for (k = j; k < j + len; k++)
+	__set_bit(k, (unsigned long*)bh->b_data); /* see <linux/Documentation/atomic_ops.txt> */
+      gi->gri_free -= len;
+      /* next search in this group starts just beyond this run */
+      j += base;
+      gi->gri_rotor = j + len;
     }
-    spin_unlock(&bitmap_lock);
+    spin_unlock(&gi->gri_lock);
+    if (found) break;
+    brelse(bh);
   }
-  return 0;
+  if (!found) return 0;
+
+  /* account for the run, and push the bitmap back to the disk */
+  percpu_counter_sub(&sbi->sbi_free_blocks, len);
+  mark_buffer_dirty(bh);
+  brelse(bh);
+  *count = len;
+  return j;
+}
+
+/** 
+ * wufs_new_block: (utility function)
+ * Allocate a single new block on the disk, preferably at goal
+ * (see wufs_new_blocks).
+ * Returns the lba of the new block, or 0 if the disk is full.
+ */
+unsigned long wufs_new_block(struct inode * inode, unsigned long goal)
+{
+  unsigned long count;
+  return wufs_new_blocks(inode, goal, 1, 1, &count);
 }
 
 /**
@@ -198,48 +524,76 @@ int wufs_new_block(struct inode * inode)
  * Simply: clear the bit at the appropriate offset in the bitmap.
  */
 void wufs_free_block(struct inode *inode, unsigned long block)
+{
+  wufs_free_blocks(inode, block, 1);
+}
+
+/**
+ * wufs_free_blocks: (utility function)
+ * Free the count blocks that begin at block (e.g. an extent).
+ * The bits are cleared a group at a time: one bitmap buffer update and
+ * one critical section per group touched.
+ */
+void wufs_free_blocks(struct inode *inode, unsigned long block,
+		      unsigned long count)
 {
   /* grab our local info structures */
   struct super_block *sb = inode->i_sb;
   struct wufs_sb_info *sbi = wufs_sb(sb);
+  struct wufs_group_info *gi;
   struct buffer_head *bh;
   int bits_per_block = 8 * inode->i_sb->s_blocksize;
-  unsigned long bit, mapBlock;
-  int previous;
+  unsigned long bit, mapBlock, n, k, freed, cleared;
+  int counted;
 
   /* sanity check: we're only working with data blocks */
-  if (block < sbi->sbi_first_block || block >= sbi->sbi_blocks) {
-    printk("wufs_free_block: Trying to free non-data block %lu\n",block);
+  if (block < sbi->sbi_first_block || block + count > sbi->sbi_blocks ||
+      block + count < block) {
+    printk("wufs_free_blocks: Trying to free non-data blocks %lu+%lu\n",
+	   block, count);
     return;
   }
 
-  /* break bit offset into block offset in map and bit offset in block */
-  bit = block % bits_per_block;
-  mapBlock = block/bits_per_block;
-  if (mapBlock >= sbi->sbi_bmap_bcnt) {
-    printk("wufs_free_block: nonexistent bitmap buffer, %lu\n",mapBlock);
-    return;
+  while (count) {
+    /* break bit offset into block offset in map and bit offset in block */
+    bit = block % bits_per_block;
+    mapBlock = block/bits_per_block;
+    n = min(count, bits_per_block - bit); /* (blocks within this group) */
+
+    /* grab the buffer head and allocation group */
+    bh = read_bitmap(sb, sbi->sbi_bmap_start, mapBlock);
+    if (!bh) return;
+    gi = sbi->sbi_groups + mapBlock;
+
+    /* get exclusive access */
+    spin_lock(&gi->gri_lock);
+    freed = 0;
+    for (k = bit; k < bit + n; k++)
+      freed += __test_and_clear_bit(k, (unsigned long*)bh->b_data); /* see <linux/Documentation/atomic_ops.txt> */
+    /* (an uncounted group picks this up when its census is taken) */
+    counted = gi->gri_counted;
+    if (counted) gi->gri_free += freed;
+    spin_unlock(&gi->gri_lock);
+
+    /* check status (outside the critical section!) */
+    cleared = n - freed;
+    if (cleared) printk("wufs_free_blocks (%s:%lu): %lu bits already cleared\n",
+			sb->s_id, block, cleared);
+    if (counted) percpu_counter_add(&sbi->sbi_free_blocks, freed);
+
+    /* flush bitmap buffer */
+    mark_buffer_dirty(bh);
+    brelse(bh);
+    block += n;
+    count -= n;
   }
-  /* grab the buffer head */
-  bh = sbi->sbi_bmap[mapBlock];
-
-  /* get exclusive access */
-  spin_lock(&bitmap_lock);
-  previous = __test_and_clear_bit(bit, (unsigned long*)bh->b_data); /* see <linux/Documentation/atomic_ops.txt> */
-  spin_unlock(&bitmap_lock);
-  
-  /* check status (outside the critical section!) */
-  if (!previous) printk("wufs_free_block (%s:%lu): bit already cleared\n",
-			sb->s_id, block);
-
-  /* flush bitmap buffer */
-  mark_buffer_dirty(bh);
-  return;
 }
 
 /**
  * wufs_new_inode: (utility function)
- * Allocate a new inode within a particular directory.
+ * Allocate a new inode within a particular directory.  The search is
+ * sharded like block allocation: each inode group has its own lock and
+ * rotor, and the search begins in the current cpu's group.
  * Returns error code by reference.
  */
 struct inode *wufs_new_inode(const struct inode *dir, int *error)
@@ -253,61 +607,71 @@ struct inode *wufs_new_inode(const struct inode *dir, int *error)
    * this calls (indirectly) wufs_alloc_inode (see inode.c)
    */
   struct inode *inode = new_inode(sb);
-  struct buffer_head * bh;
-  int i;
+  struct buffer_head *bh = NULL;
+  struct wufs_group_info *gi;
+  unsigned long ngroups = sbi->sbi_igroup_cnt;
+  unsigned long g, n, lo, hi, base, start, j, ino = 0;
+  int i, found = 0;
 
   /* compute the number of map bits that occur in each block of imap */
   int bits_per_block = 8 * sb->s_blocksize;
-  unsigned long ino;
 
   /* verify that vfs could create an inode */
   if (!inode) { *error = -ENOMEM; return NULL; }
-
-  /* set sentinel values for failed lookup */
-  ino = bits_per_block;
-  bh = NULL;
   *error = -ENOSPC;
-  
-  /* lock down bitmap */
-  spin_lock(&bitmap_lock);
-  for (i = 0; i < sbi->sbi_imap_bcnt; i++) {
-    bh = sbi->sbi_imap[i];
-    ino = find_first_zero_bit((unsigned long*)bh->b_data, bits_per_block);
-    if (ino < bits_per_block) {
-      /* found an available inode index */
-      break;
-    }
-  }
 
-  /* 
-   * At this point, i is the block number, bh is its buffer_head, and ino,
-   * if a reasonable value, is the distance within that block
-   * First, some sanity checking:
+  /*
+   * Like block allocation, begin in the current cpu's group, so parallel
+   * creators work in different groups (under different locks).
    */
-  if (!bh || ino >= bits_per_block) {
-    spin_unlock(&bitmap_lock);
-
-    /* iput is the mechanism for getting vfs to destroy an inode */
-    iput(inode);
-    return NULL;
+  g = raw_smp_processor_id() % ngroups;
+  for (n = 0; n < ngroups; n++, g = (g + 1) % ngroups) {
+    gi = sbi->sbi_igroups + g;
+
+    /* quick (unlocked) check: skip full groups without reading the map */
+    if (!gi->gri_free) continue;
+    igroup_bounds(sbi, g, &lo, &hi);
+    /* bring in the block of the inode map holding this group */
+    i = lo / bits_per_block;
+    base = i * bits_per_block;
+    bh = read_bitmap(sb, sbi->sbi_imap_start, i);
+    if (!bh) continue;
+
+    /* search from the rotor to the end of the group, then wrap */
+    spin_lock(&gi->gri_lock);
+    start = gi->gri_rotor;
+    if (start < lo || start >= hi) start = lo;
+    j = find_next_zero_bit((unsigned long *)bh->b_data, hi - base, start - base);
+    if (j >= hi - base) {
+      j = find_next_zero_bit((unsigned long *)bh->b_data, start - base, lo - base);
+      if (j >= start - base) j = hi - base;
+    }
+    found = (j < hi - base);
+    if (found) {
+      /* groups never share a word of the map: the group lock suffices */
+      __set_bit(j, (unsigned long *)bh->b_data);
+      gi->gri_free--;
+      /* inode *index* (0-origin) of the allocated inode */
+      ino = base + j;
+      gi->gri_rotor = ino + 1;
+    }
+    spin_unlock(&gi->gri_lock);
+    if (found) break;
+    brelse(bh);
   }
-  /* we're still locked...set the bit */
-  if (__test_and_set_bit(ino, (unsigned long*)bh->b_data)) {
-    /* for some reason, the bit was set - shouldn't happen, of course */
-    spin_unlock(&bitmap_lock);
-    printk("wufs_new_inode: bit already set\n");
-
+  if (!found) {
     /* iput is the mechanism for getting vfs to destroy an inode */
     iput(inode);
     return NULL;
   }
-  spin_unlock(&bitmap_lock);
+  percpu_counter_dec(&sbi->sbi_free_inodes);
 
   /* great - bitmap is set; write it out */
   mark_buffer_dirty(bh);
+  brelse(bh);
 
   /* now compute the actual inode *number* */
-  ino += i * bits_per_block + 1;
+  ino++;
 
   /* sanity check */
   if (!ino || ino > sbi->sbi_inodes) {
@@ -330,7 +694,7 @@ struct inode *wufs_new_inode(const struct inode *dir, int *error)
 
   /* initialize all data & size fields */
   inode->i_blocks = 0;
-  for (i = 0; i < WUFS_INODE_BPTRS; i++) {
+  for (i = 0; i < WUFS_INODE32_BPTRS; i++) {
     wufs_i(inode)->ini_data[i] = 0;
   }
 
@@ -355,8 +719,10 @@ void wufs_free_inode(struct inode * inode)
 {
   struct wufs_sb_info *sbi = wufs_sb(inode->i_sb);
   struct buffer_head *bh;
-  int bits_per_block = 8 * WUFS_BLOCKSIZE;
+  struct wufs_group_info *gi;
+  int bits_per_block = 8 * inode->i_sb->s_blocksize;
   unsigned long ino, bit, mapBlock;
+  int freed;
 
   /* grab the inode *number* */
   ino = inode->i_ino;
@@ -379,15 +745,22 @@ void wufs_free_inode(struct inode * inode)
   wufs_clear_inode(inode);
 
   /* now, clear the associated bit */
-  bh = sbi->sbi_imap[mapBlock];
+  bh = read_bitmap(inode->i_sb, sbi->sbi_imap_start, mapBlock);
+  if (!bh) goto out;
 
-  spin_lock(&bitmap_lock);
+  gi = sbi->sbi_igroups + ino / WUFS_IGROUP_BITS;
+  spin_lock(&gi->gri_lock);
   /* clear the bit: */
-  if (!__test_and_clear_bit(bit, (unsigned long*)bh->b_data))
+  freed = __test_and_clear_bit(bit, (unsigned long*)bh->b_data);
+  if (freed) gi->gri_free++;
+  spin_unlock(&gi->gri_lock);
+  if (!freed)
     printk("wufs_free_inode: bit %lu already cleared\n", bit);
-  spin_unlock(&bitmap_lock);
+  else
+    percpu_counter_inc(&sbi->sbi_free_inodes);
   /* write back bitmap */
   mark_buffer_dirty(bh);
+  brelse(bh);
  out:
   /* clear the vfs inode, marking it for deletion (see linux/fs/inode.c) */
   clear_inode(inode);
@@ -423,14 +796,16 @@ static void wufs_clear_inode(struct inode *inode)
  * wufs_raw_inode: (utility function)
  * Get the WUFS disk-resident inode from inode number.
  * Returns pointer to associated buffer head for use by caller.
+ * From version 3, the inode is really a (larger) wufs_inode32; the fields
+ * before the block pointers are common to both.
  */
 struct wufs_inode *
 wufs_raw_inode(struct super_block *sb, ino_t ino, struct buffer_head **bh)
 {
-  int block;
+  unsigned long block, per_block;
   /* get the superblock info structure */
   struct wufs_sb_info *sbi = wufs_sb(sb);
-  struct wufs_inode *inodep;
+  char *inodep;
 
   /*
    * These are inode *numbers*, which start at 1 and range to sbi_inodes
@@ -449,18 +824,19 @@ wufs_raw_inode(struct super_block *sb, ino_t ino, struct buffer_head **bh)
    * Compute the LBA of the inode, skipping boot, super, and map blocks, and
    * reaching into the inode array block set
    */
-  block = 2 + sbi->sbi_imap_bcnt + sbi->sbi_bmap_bcnt; /* LBAs before array */
-  block += ino / WUFS_INODES_PER_BLOCK;
+  per_block = sb->s_blocksize / sbi->sbi_inode_size;
+  block = sbi->sbi_bmap_start + sbi->sbi_bmap_bcnt; /* LBAs before array */
+  block += ino / per_block;
 
   /* read the block, based on superblock info (see <linux/buffer_head.h>) */
   *bh = sb_bread(sb, block);
   if (!*bh) {
-    printk("wufs_raw_inode: Unable to read inode %d, block %d\n",
+    printk("wufs_raw_inode: Unable to read inode %d, block %lu\n",
 	   (int)(ino+1),block);
     return NULL;
   }
 
   /* compute (raw) inode pointer */
-  inodep = (void *)(*bh)->b_data;
-  return inodep + (ino % WUFS_INODES_PER_BLOCK);
+  inodep = (*bh)->b_data;
+  return (struct wufs_inode *)(inodep + (ino % per_block) * sbi->sbi_inode_size);
 }
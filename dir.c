@@ -8,9 +8,32 @@
 #include <linux/buffer_head.h>
 #include <linux/highmem.h>
 #include <linux/swap.h>
+#include <linux/slab.h>
+#include <linux/sort.h>
 
 typedef struct wufs_dirent wufs_dentry;
 
+/**
+ * dx_frame:
+ * One index block (the root, or a node) on the path to a hashed
+ * directory's leaf.
+ */
+struct dx_frame {
+  struct page          *page;	/* the mapped page holding the block */
+  char                 *block;	/* the index block */
+  struct wufs_dx_head  *head;	/* its head */
+  struct wufs_dx_entry *at;	/* the entry followed (NULL if none) */
+};
+
+/**
+ * dx_slot:
+ * The hash of the name in a leaf slot (used when splitting the leaf).
+ */
+struct dx_slot {
+  __u32    hash;
+  unsigned slot;
+};
+
 /*
  * Exported entrypoints.
  */
@@ -32,9 +55,65 @@ void         wufs_set_link(wufs_dentry *de,
  */
 static int                  dir_commit_chunk(struct page *page,
 					     loff_t pos, unsigned len);
+static struct page         *dir_get_block(struct inode *dir,
+					  unsigned long blk, char **block);
+static int                  dir_check_page(struct inode *dir,
+					   struct page *page);
 static struct page         *dir_get_page(struct inode *dir, unsigned long n);
+static unsigned             dir_realign(struct inode *dir, char *kaddr,
+					unsigned offset);
+static inline __u32         dirent_ino(struct wufs_sb_info *sbi, void *de);
+static inline int           dirent_match(struct wufs_sb_info *sbi, void *de,
+					 const char *name, int len);
+static inline char         *dirent_name(struct wufs_sb_info *sbi, void *de);
+static inline unsigned      dirent_namelen(struct wufs_sb_info *sbi, void *de);
+static inline void          dirent_set_type(struct wufs_sb_info *sbi, void *de,
+					    umode_t mode);
+static inline void          dirent_set_ino(struct wufs_sb_info *sbi, void *de,
+					   __u32 ino);
+static inline unsigned      dirent_size(struct wufs_sb_info *sbi, void *de);
+static inline unsigned char dirent_type(struct wufs_sb_info *sbi, void *de);
+static inline loff_t        dir_pos(struct page *page, void *p);
+static int                  dir_prepare_chunk(struct page *page,
+					      loff_t pos, unsigned len);
+static int                  dc_build(struct inode *dir);
+static wufs_dentry         *dc_find_entry(struct inode *dir,
+					  const char *name, int namelen,
+					  struct page **res_page);
+static int                  dx_add_link(struct inode *dir, const char *name,
+					int namelen, struct inode *inode);
+static long                 dx_append_block(struct inode *dir,
+					    const void *src, unsigned len);
+static inline struct wufs_dx_entry *dx_entries(struct wufs_dx_head *h);
+static wufs_dentry         *dx_find_entry(struct inode *dir,
+					  const char *name, int namelen,
+					  struct page **res_page);
+static int                  dx_grow_index(struct inode *dir,
+					  struct dx_frame *frames, int n);
+static __u32                dx_hash(const char *name, int len);
+static int                  dx_indexed(struct inode *dir);
+static unsigned             dx_index_bytes(struct inode *dir,
+					   unsigned long n, char *kaddr,
+					   char *p);
+static int                  dx_insert(struct inode *dir, struct dx_frame *f,
+				      __u32 hash, unsigned long blk);
+static int                  dx_next_leaf(struct inode *dir,
+					 struct dx_frame *frames, int n,
+					 __u32 hash);
+static inline int           dx_is_head(struct wufs_dx_head *h);
+static inline unsigned      dx_limit(struct inode *dir, int root);
+static int                  dx_probe(struct inode *dir, __u32 hash,
+				     struct dx_frame *frames);
+static void                 dx_release(struct dx_frame *frames, int n);
+static inline struct wufs_dx_head *dx_root_head(char *block);
+static struct wufs_dx_entry *dx_search(struct wufs_dx_head *h, __u32 hash);
+static int                  dx_slot_cmp(const void *a, const void *b);
+static int                  dx_split_leaf(struct inode *dir,
+					  struct dx_frame *frames, int n,
+					  struct page *page, char *block);
 static inline unsigned long dir_pages(struct inode *inode);
 static inline void          dir_put_page(struct page *page);
+static inline int           filetype(struct wufs_sb_info *sbi);
 static inline int           namecompare(int len, int maxlen,
 			                const char * name, const char * buffer);
 static unsigned             wufs_last_byte(struct inode *inode,
@@ -42,10 +121,40 @@ static unsigned             wufs_last_byte(struct inode *inode,
 static inline void         *wufs_next_entry(void *de, struct wufs_sb_info *sbi);
 static int                  wufs_readdir(struct file * filp,
 					 void * dirent, filldir_t filldir);
+static int                  var_add_link(struct inode *dir, const char *name,
+					 int namelen, struct inode *inode);
+static inline int           vardir(struct wufs_sb_info *sbi);
 
 /*
  * Global variables.
  */
+/**
+ * wufs_type_by_mode, wufs_filetype_table:
+ * The WUFS_FT_* file type for each S_IFMT file mode, and the readdir
+ * (DT_*) type for each WUFS_FT_* file type.
+ */
+#define WUFS_S_SHIFT 12
+static const unsigned char wufs_type_by_mode[S_IFMT >> WUFS_S_SHIFT] = {
+  [S_IFREG >> WUFS_S_SHIFT]	= WUFS_FT_REG_FILE,
+  [S_IFDIR >> WUFS_S_SHIFT]	= WUFS_FT_DIR,
+  [S_IFCHR >> WUFS_S_SHIFT]	= WUFS_FT_CHRDEV,
+  [S_IFBLK >> WUFS_S_SHIFT]	= WUFS_FT_BLKDEV,
+  [S_IFIFO >> WUFS_S_SHIFT]	= WUFS_FT_FIFO,
+  [S_IFSOCK >> WUFS_S_SHIFT]	= WUFS_FT_SOCK,
+  [S_IFLNK >> WUFS_S_SHIFT]	= WUFS_FT_SYMLINK,
+};
+
+static const unsigned char wufs_filetype_table[WUFS_FT_MAX] = {
+  [WUFS_FT_UNKNOWN]	= DT_UNKNOWN,
+  [WUFS_FT_REG_FILE]	= DT_REG,
+  [WUFS_FT_DIR]		= DT_DIR,
+  [WUFS_FT_CHRDEV]	= DT_CHR,
+  [WUFS_FT_BLKDEV]	= DT_BLK,
+  [WUFS_FT_FIFO]	= DT_FIFO,
+  [WUFS_FT_SOCK]	= DT_SOCK,
+  [WUFS_FT_SYMLINK]	= DT_LNK,
+};
+
 const struct file_operations wufs_dir_operations = {
   .llseek	= generic_file_llseek,
   .read		= generic_read_dir,
@@ -85,7 +194,7 @@ static int wufs_readdir(struct file *filp, void *dirent, filldir_t filldir)
   __u32 inumber;
 
   /* find the offset to the base of the next dirent */
-  pos = (pos + chunk_size-1) & ~(chunk_size-1);
+  if (!vardir(sbi)) pos = (pos + chunk_size-1) & ~(chunk_size-1);
   
   /* check for end-of-file */
   if (pos >= inode->i_size) { goto done; }
@@ -101,21 +210,29 @@ static int wufs_readdir(struct file *filp, void *dirent, filldir_t filldir)
     /* get the kernel address associated with mapped page */
     kaddr = (char *)page_address(page);
     /* p is the kernel address of the next dirent record */
+    if (vardir(sbi)) offset = dir_realign(inode, kaddr, offset);
     p = kaddr+offset;
     /* p cannot be beyond limit, lest the dirent extend past end of page */
     limit = kaddr + wufs_last_byte(inode, n) - chunk_size;
     for ( ; p <= limit; p = wufs_next_entry(p, sbi)) {
-      /* here's the next raw dentry */
-      wufs_dentry *de = (wufs_dentry *)p;
+      /* the index of a hashed directory is not made of dentries: skip it */
+      unsigned skip = dx_index_bytes(inode, n, kaddr, p);
+
+      if (skip) {
+	p += skip - chunk_size;
+	continue;
+      }
       /* get to the name */
-      name = de->de_name;
+      name = dirent_name(sbi, p);
       /* inode number of the file */
-      inumber = de->de_ino;
+      inumber = dirent_ino(sbi, p);
       if (inumber) { /* entry is valid if inumber non-zero */
 	int over;
 
 	/* (carefully) compute the length of the entry name */
-	unsigned l = strnlen(name, sbi->sbi_namelen);
+	unsigned l = dirent_namelen(sbi, p);
+	/* the file's type, if the entry records it (else DT_UNKNOWN) */
+	unsigned char type = dirent_type(sbi, p);
 	/* recompute the offset into the current page */
 	offset = p - kaddr;
 
@@ -123,7 +240,8 @@ static int wufs_readdir(struct file *filp, void *dirent, filldir_t filldir)
 	 * call the callback function to fill in the vfs directory entry
 	 * fields from the WUFS dentry.
 	 */
-	over = filldir(dirent, name, l, (n << PAGE_CACHE_SHIFT) | offset, inumber, DT_UNKNOWN);
+	over = filldir(dirent, name, l, (n << PAGE_CACHE_SHIFT) | offset, inumber,
+		       type < WUFS_FT_MAX ? wufs_filetype_table[type] : DT_UNKNOWN);
 	if (over) {
 	  /* free the directory page */
 	  dir_put_page(page);
@@ -173,10 +291,19 @@ wufs_dentry *wufs_find_entry(struct dentry *dentry, struct page **res_page)
   struct page *page = NULL;
   char *p;
 
-  char *namx;
   __u32 inumber;
   *res_page = NULL;
 
+  /* a hashed directory: consult the index */
+  if (dx_indexed(dir))
+    return dx_find_entry(dir, name, namelen, res_page);
+
+  /* a linear directory: consult its name cache, if enabled */
+  if (wufs_test_opt(sb, WUFS_MOUNT_DIRCACHE)) {
+    wufs_dentry *de = dc_find_entry(dir, name, namelen, res_page);
+    if (!IS_ERR(de)) return de;
+  }
+
   /* start search from the beginning of directory */
   for (n = 0; n < npages; n++) {
     char *kaddr, *limit;
@@ -190,15 +317,11 @@ wufs_dentry *wufs_find_entry(struct dentry *dentry, struct page **res_page)
     kaddr = (char*)page_address(page);
     limit = kaddr + wufs_last_byte(dir, n) - sbi->sbi_dirsize;
     for (p = kaddr; p <= limit; p = wufs_next_entry(p, sbi)) {
-      /* consider the next entry */
-      wufs_dentry *de = (wufs_dentry *)p;
-      /* get raw WUFS dentry name */
-      namx = de->de_name;
-      /*  ... and inode */
-      inumber = de->de_ino;
+      /* consider the next entry's inode */
+      inumber = dirent_ino(sbi, p);
       if (!inumber) continue; /* unused dentry */
       /* now, check the name */
-      if (namecompare(namelen, sbi->sbi_namelen, name, namx))
+      if (dirent_match(sbi, p, name, namelen))
 	goto found; /* found it */
     }
     /* free page and move along to next directory page */
@@ -217,7 +340,120 @@ wufs_dentry *wufs_find_entry(struct dentry *dentry, struct page **res_page)
  */
 static inline void *wufs_next_entry(void *de, struct wufs_sb_info *sbi)
 {
-  return (void*)((char*)de + sbi->sbi_dirsize);
+  return (void*)((char*)de + dirent_size(sbi, de));
+}
+
+/*
+ * Directory entries are either classic (fixed size wufs_dirent) or, with
+ * the vardir feature, variable length (wufs_dirent2).  The following
+ * routines hide the difference.
+ */
+
+/**
+ * vardir: (utility function)
+ * Return true iff directory entries vary in length.
+ */
+static inline int vardir(struct wufs_sb_info *sbi)
+{
+  return (sbi->sbi_features & WUFS_FEATURE_VARDIR) != 0;
+}
+
+/**
+ * dirent_ino: (utility function)
+ * The inode number of entry de (0 if unused).
+ */
+static inline __u32 dirent_ino(struct wufs_sb_info *sbi, void *de)
+{
+  if (vardir(sbi)) return ((struct wufs_dirent2 *)de)->de_ino;
+  return ((wufs_dentry *)de)->de_ino;
+}
+
+/**
+ * dirent_set_ino: (utility function)
+ * Set the inode number of entry de.
+ */
+static inline void dirent_set_ino(struct wufs_sb_info *sbi, void *de, __u32 ino)
+{
+  if (vardir(sbi)) ((struct wufs_dirent2 *)de)->de_ino = ino;
+  else ((wufs_dentry *)de)->de_ino = ino;
+}
+
+/**
+ * dirent_name: (utility function)
+ * The name of entry de (not necessarily null terminated).
+ */
+static inline char *dirent_name(struct wufs_sb_info *sbi, void *de)
+{
+  if (vardir(sbi)) return ((struct wufs_dirent2 *)de)->de_name;
+  return ((wufs_dentry *)de)->de_name;
+}
+
+/**
+ * dirent_namelen: (utility function)
+ * The length of the name of entry de.
+ */
+static inline unsigned dirent_namelen(struct wufs_sb_info *sbi, void *de)
+{
+  if (vardir(sbi)) return ((struct wufs_dirent2 *)de)->de_name_len;
+  return strnlen(((wufs_dentry *)de)->de_name, sbi->sbi_namelen);
+}
+
+/**
+ * dirent_size: (utility function)
+ * The number of bytes from entry de to the next.
+ */
+static inline unsigned dirent_size(struct wufs_sb_info *sbi, void *de)
+{
+  if (vardir(sbi)) return ((struct wufs_dirent2 *)de)->de_rec_len;
+  return sbi->sbi_dirsize;
+}
+
+/**
+ * filetype: (utility function)
+ * Return true iff directory entries record the types of their files.
+ */
+static inline int filetype(struct wufs_sb_info *sbi)
+{
+  return (sbi->sbi_features & WUFS_FEATURE_FILETYPE) != 0;
+}
+
+/**
+ * dirent_type: (utility function)
+ * The WUFS_FT_* type of the file named by entry de (WUFS_FT_UNKNOWN if
+ * entries do not record it).
+ */
+static inline unsigned char dirent_type(struct wufs_sb_info *sbi, void *de)
+{
+  if (!filetype(sbi)) return WUFS_FT_UNKNOWN;
+  if (vardir(sbi)) return ((struct wufs_dirent2 *)de)->de_file_type;
+  return ((wufs_dentry *)de)->de_name[WUFS_NAMELEN - 1];
+}
+
+/**
+ * dirent_set_type: (utility function)
+ * Record, in entry de, the type of a file of the given mode (if entries
+ * record types).
+ */
+static inline void dirent_set_type(struct wufs_sb_info *sbi, void *de,
+				   umode_t mode)
+{
+  unsigned char type = wufs_type_by_mode[(mode & S_IFMT) >> WUFS_S_SHIFT];
+
+  if (!filetype(sbi)) return;
+  if (vardir(sbi)) ((struct wufs_dirent2 *)de)->de_file_type = type;
+  else ((wufs_dentry *)de)->de_name[WUFS_NAMELEN - 1] = type;
+}
+
+/**
+ * dirent_match: (utility function)
+ * Return 1 if the name of entry de is the len byte name, 0 otherwise.
+ */
+static inline int dirent_match(struct wufs_sb_info *sbi, void *de,
+			       const char *name, int len)
+{
+  if (vardir(sbi))
+    return dirent_namelen(sbi, de) == len && !memcmp(dirent_name(sbi, de), name, len);
+  return namecompare(len, sbi->sbi_namelen, name, dirent_name(sbi, de));
 }
 
 /**
@@ -230,13 +466,25 @@ int wufs_delete_entry(wufs_dentry *de, struct page *page)
   char *kaddr = page_address(page);
   /* directory being mapped */
   struct inode *inode = (struct inode*)mapping->host;
+  struct wufs_inode_info *ei = wufs_i(inode);
   /* determine the position of de in the directory file */
   loff_t pos = page_offset(page) + (char*)de - kaddr;
   /* determine size of the directory entry */
   struct wufs_sb_info *sbi = wufs_sb(inode->i_sb);
   unsigned len = sbi->sbi_dirsize;
+  struct wufs_dirent2 *prev = NULL;
   int err;
 
+  if (vardir(sbi)) {
+    /* find the entry before de in its block; it will absorb de */
+    char *p = kaddr + (((char *)de - kaddr) & ~(inode->i_sb->s_blocksize - 1));
+
+    for ( ; p < (char *)de; p = wufs_next_entry(p, sbi))
+      prev = (struct wufs_dirent2 *)p;
+    if (prev) pos = dir_pos(page, prev);
+    len = (char *)de + dirent_size(sbi, de) - (prev ? (char *)prev : (char *)de);
+  }
+
   /* avoid race conditions; lock page, update; unlock */
   lock_page(page);
   /* prepare for write */
@@ -244,9 +492,17 @@ int wufs_delete_entry(wufs_dentry *de, struct page *page)
 			   AOP_FLAG_UNINTERRUPTIBLE, &page, NULL);
   if (err == 0) {
     /* we're ready; zero the inode, indicating empty dentry */
-    de->de_ino = 0;
+    dirent_set_ino(sbi, de, 0);
+    /* ...and (variable length entries) fold it into its predecessor */
+    if (prev) prev->de_rec_len = len;
     /* force write */
     err = dir_commit_chunk(page, pos, len);
+    /* the name is gone */
+    wufs_dircache_remove(inode, dirent_name(sbi, de),
+			 dirent_namelen(sbi, de));
+    /* ...and its slot is free */
+    if (pos < ei->ini_free_hint) ei->ini_free_hint = pos;
+    if (ei->ini_free_count >= 0) ei->ini_free_count++;
   } else {
     /* failed on write, unlock page and return */
     unlock_page(page);
@@ -273,16 +529,21 @@ int wufs_make_empty(struct inode *inode, struct inode *dir)
   struct page *page = grab_cache_page(mapping, 0);
   /* Get info associated with the containing file system */
   struct wufs_sb_info *sbi = wufs_sb(inode->i_sb);
+  /* with the dir_index feature, the first block is the root of an index */
+  int hashed = wufs_has_feature(inode->i_sb, WUFS_FEATURE_DIR_INDEX);
+  /* (variable length entries always fill their blocks) */
+  unsigned len = (hashed || vardir(sbi)) ? inode->i_sb->s_blocksize
+					 : 2 * sbi->sbi_dirsize;
   wufs_dentry *de;
   char *kaddr;
   int err;
 
   if (!page)
     return -ENOMEM;
-  /* Get ready to write 2*sizeof(wufs_dentry) bytes from dir's 0 page.
-   * Capture page number into page.
+  /* Get ready to write 2*sizeof(wufs_dentry) bytes (or the whole root
+   * block) from dir's 0 page.  Capture page number into page.
    */
-  err = __wufs_write_begin(NULL, mapping, 0, 2 * sbi->sbi_dirsize,
+  err = __wufs_write_begin(NULL, mapping, 0, len,
 			   AOP_FLAG_UNINTERRUPTIBLE, &page, NULL);
   if (err) {
     /* no ready: backout */
@@ -295,17 +556,50 @@ int wufs_make_empty(struct inode *inode, struct inode *dir)
   /* ...zap any dirents */
   memset(kaddr, 0, PAGE_CACHE_SIZE);
   /* write two dentries: "." and ".." */
-  de = (wufs_dentry *)kaddr;
-  de->de_ino = inode->i_ino;
-  strcpy(de->de_name, ".");
-  /* move on to second entry */
-  de = wufs_next_entry(de, sbi);
-  de->de_ino = dir->i_ino;
-  strcpy(de->de_name, "..");
+  if (vardir(sbi)) {
+    struct wufs_dirent2 *de2 = (struct wufs_dirent2 *)kaddr;
+
+    de2->de_ino = inode->i_ino;
+    de2->de_rec_len = WUFS_DIRENT2_SIZE(1);
+    de2->de_name_len = 1;
+    memcpy(de2->de_name, ".", 1);
+    /* ".." takes the rest of the block */
+    de2 = wufs_next_entry(de2, sbi);
+    de2->de_ino = dir->i_ino;
+    de2->de_rec_len = len - WUFS_DIRENT2_SIZE(1);
+    de2->de_name_len = 2;
+    memcpy(de2->de_name, "..", 2);
+  } else {
+    de = (wufs_dentry *)kaddr;
+    de->de_ino = inode->i_ino;
+    strcpy(de->de_name, ".");
+    /* move on to second entry */
+    de = wufs_next_entry(de, sbi);
+    de->de_ino = dir->i_ino;
+    strcpy(de->de_name, "..");
+  }
+  dirent_set_type(sbi, kaddr, S_IFDIR);
+  dirent_set_type(sbi, wufs_next_entry(kaddr, sbi), S_IFDIR);
+  if (hashed) {
+    /* ...followed by the head of an (empty) index */
+    struct wufs_dx_head *h = dx_root_head(kaddr);
+    h->dh_magic = WUFS_DX_MAGIC;
+    h->dh_limit = dx_limit(inode, 1);
+  }
   kunmap_atomic(kaddr, KM_USER0);
 
   /* Now, do the write */
-  err = dir_commit_chunk(page, 0, 2 * sbi->sbi_dirsize);
+  err = dir_commit_chunk(page, 0, len);
+  /* (see dx_indexed) */
+  wufs_i(inode)->ini_indexed = !!hashed;
+  /* a new linear directory is full: the next entry goes at its end */
+  wufs_i(inode)->ini_free_hint = len;
+  wufs_i(inode)->ini_free_count = 0;
+  if (vardir(sbi)) {
+    /* ...but for the room after ".." */
+    wufs_i(inode)->ini_free_hint = WUFS_DIRENT2_SIZE(1);
+    wufs_i(inode)->ini_free_count = -1;
+  }
  fail:
   page_cache_release(page);
   return err;
@@ -323,6 +617,7 @@ int wufs_empty_dir(struct inode *inode)
   /* Get file system parameters */
   struct wufs_sb_info *sbi = wufs_sb(inode->i_sb);
   char *name;
+  unsigned len;
   __u32 inumber;
 
   /* consider each page, in turn */
@@ -338,24 +633,27 @@ int wufs_empty_dir(struct inode *inode)
     kaddr = (char *)page_address(page);
     limit = kaddr + wufs_last_byte(inode, i) - sbi->sbi_dirsize;
     for (p = kaddr; p <= limit; p = wufs_next_entry(p, sbi)) {
-      /* consider the next entry: */
-      wufs_dentry *de = (wufs_dentry *)p;
+      /* (the index of a hashed directory holds no entries) */
+      unsigned skip = dx_index_bytes(inode, i, kaddr, p);
 
+      if (skip) {
+	p += skip - sbi->sbi_dirsize;
+	continue;
+      }
       /* get the name and inode */
-      name = de->de_name;
-      inumber = de->de_ino;
+      name = dirent_name(sbi, p);
+      len = dirent_namelen(sbi, p);
+      inumber = dirent_ino(sbi, p);
 
       if (inumber != 0) { /* valid directory entry - better be . or .. */
 	/* check for . and .. */
-	if (name[0] != '.')
+	if (len < 1 || len > 2 || name[0] != '.')
 	  goto not_empty;
-	if (!name[1]) { /* badness: . doesn't point to this directory */
+	if (len == 1) { /* badness: . doesn't point to this directory */
 	  if (inumber != inode->i_ino)
 	    goto not_empty;
 	} else if (name[1] != '.') /* other dotted file */
 	  goto not_empty;
-	else if (name[2]) /* anything longer: not empty */
-	  goto not_empty;
       }
     }
     /* finished with page */
@@ -387,22 +685,51 @@ int wufs_add_link(struct dentry *dentry, struct inode *inode)
   struct wufs_sb_info * sbi = wufs_sb(sb);
 
   /* set up for a directory search */
+  struct wufs_inode_info *ei = wufs_i(dir);
   struct page *page = NULL;
   unsigned long npages = dir_pages(dir);
   unsigned long n;
+  unsigned offset;
   char *kaddr, *p;
   wufs_dentry *de;
-  loff_t pos;
-  int err;
+  loff_t pos, start;
+  int err, append = 0;
   char *namx = NULL;
   __u32 inumber;
 
+  /* a hashed directory: the index names the only block to search */
+  if (dx_indexed(dir))
+    return dx_add_link(dir, name, namelen, inode);
+
+  /*
+   * The search below starts at the first free slot, and so sees only part
+   * of the directory: make sure the name is not already present elsewhere.
+   * (With a name cache this is cheap; without one, wufs_find_entry scans
+   * the whole directory.)
+   */
+  de = wufs_find_entry(dentry, &page);
+  if (de) {
+    dir_put_page(page);
+    return -EEXIST;
+  }
+
+  /* entries of varying length are placed by size */
+  if (vardir(sbi))
+    return var_add_link(dir, name, namelen, inode);
+
+  /*
+   * Begin where the first free slot may be; or, if we know there are none,
+   * at the end.
+   */
+  start = ei->ini_free_count ? ei->ini_free_hint : dir->i_size;
+
   /*
    * Because the directory may expand we have to reach beyond
    * the directory's end.  We lock the page to protect the critical 
    * code.
    */
-  for (n = 0; n <= npages; n++) {
+  offset = start & ~PAGE_CACHE_MASK;
+  for (n = start >> PAGE_CACHE_SHIFT; n <= npages; n++, offset = 0) {
     char *limit, *dir_end;
 
     /* get n'th page of the directory */
@@ -419,7 +746,7 @@ int wufs_add_link(struct dentry *dentry, struct inode *inode)
     dir_end = kaddr + wufs_last_byte(dir, n);
     /* end of page in memory */
     limit = kaddr + PAGE_CACHE_SIZE - sbi->sbi_dirsize;
-    for (p = kaddr; p <= limit; p = wufs_next_entry(p, sbi)) {
+    for (p = kaddr + offset; p <= limit; p = wufs_next_entry(p, sbi)) {
       /* consider the next entry */
       de = (wufs_dentry *)p;
       /* get the name and inode */
@@ -428,6 +755,7 @@ int wufs_add_link(struct dentry *dentry, struct inode *inode)
       if (p == dir_end) {
 	/* bummer, we have to expand directory */
 	de->de_ino = 0;
+	append = 1;
 	goto got_it;
       }
       if (!inumber) /* an empty dirent; use this one */
@@ -462,9 +790,20 @@ int wufs_add_link(struct dentry *dentry, struct inode *inode)
 
   /* establish the link between the dentries */
   de->de_ino = inode->i_ino;
+  dirent_set_type(sbi, de, inode->i_mode);
 
   /* now, write the chunk of memory to disk */
   err = dir_commit_chunk(page, pos, sbi->sbi_dirsize);
+  /* ...and remember where it went */
+  if (!err) wufs_dircache_add(dir, name, namelen, pos);
+
+  /*
+   * Every slot before this one is in use.  If we had to append, so is
+   * every slot after it: the directory has no free slots at all.
+   */
+  ei->ini_free_hint = pos + sbi->sbi_dirsize;
+  if (append) ei->ini_free_count = 0;
+  else if (ei->ini_free_count > 0) ei->ini_free_count--;
 
   /* update the containing directory's modification time */
   dir->i_mtime = dir->i_ctime = CURRENT_TIME_SEC;
@@ -484,6 +823,107 @@ int wufs_add_link(struct dentry *dentry, struct inode *inode)
   goto out_put;
 }
 
+/**
+ * var_add_link: (utility function)
+ * Add a link to inode, called name, to dir, a directory of variable length
+ * entries.  The new entry goes in the first record with room to spare
+ * (splitting it), or in a fresh block at the end of the directory.
+ */
+static int var_add_link(struct inode *dir, const char *name, int namelen,
+			struct inode *inode)
+{
+  struct wufs_sb_info *sbi = wufs_sb(dir->i_sb);
+  struct wufs_inode_info *ei = wufs_i(dir);
+  unsigned bs = dir->i_sb->s_blocksize;
+  unsigned need = WUFS_DIRENT2_SIZE(namelen);
+  unsigned long npages = dir_pages(dir);
+  unsigned long n;
+  unsigned offset, used = 0, reclen;
+  struct page *page = NULL;
+  struct wufs_dirent2 *de = NULL, *de1;
+  char *kaddr, *p;
+  loff_t pos, start;
+  int err;
+
+  /*
+   * The hint is only the first place worth looking: a record before it
+   * may yet have room for a short name, but rarely for a typical one.
+   */
+  start = ei->ini_free_hint < dir->i_size ? ei->ini_free_hint : dir->i_size;
+  offset = start & ~PAGE_CACHE_MASK;
+  for (n = start >> PAGE_CACHE_SHIFT; n <= npages; n++, offset = 0) {
+    char *dir_end;
+
+    page = dir_get_page(dir, n);
+    err = PTR_ERR(page);
+    if (IS_ERR(page)) goto out;
+
+    lock_page(page);
+    kaddr = (char *)page_address(page);
+    dir_end = kaddr + wufs_last_byte(dir, n);
+    /* the hint may have been left inside a record that has since grown */
+    if (offset) offset = dir_realign(dir, kaddr, offset);
+    for (p = kaddr + offset; p < kaddr + PAGE_CACHE_SIZE; p += reclen) {
+      de = (struct wufs_dirent2 *)p;
+      if (p == dir_end) {
+	/* no room anywhere: begin a new block, one empty record */
+	de->de_ino = 0;
+	de->de_rec_len = bs;
+	used = 0;
+	goto got_it;
+      }
+      reclen = de->de_rec_len;
+      /* (dir_check_page has seen to it that reclen is sane) */
+      used = de->de_ino ? WUFS_DIRENT2_SIZE(de->de_name_len) : 0;
+      err = -EEXIST;
+      if (de->de_ino && dirent_match(sbi, de, name, namelen))
+	goto out_unlock;
+      if (reclen >= used + need)
+	goto got_it;
+    }
+    unlock_page(page);
+    dir_put_page(page);
+  }
+  BUG();
+  return -EINVAL;
+
+ got_it:
+  pos = dir_pos(page, de);
+  reclen = de->de_rec_len;
+  err = __wufs_write_begin(NULL, page->mapping, pos, reclen,
+			   AOP_FLAG_UNINTERRUPTIBLE, &page, NULL);
+  if (err)
+    goto out_unlock;
+
+  if (used) {
+    /* split the record: its owner keeps what it uses; we take the rest */
+    de1 = (struct wufs_dirent2 *)((char *)de + used);
+    de1->de_rec_len = reclen - used;
+    de->de_rec_len = used;
+    de = de1;
+  }
+  de->de_name_len = namelen;
+  de->de_file_type = 0;
+  dirent_set_type(sbi, de, inode->i_mode);
+  memcpy(de->de_name, name, namelen);
+  de->de_ino = inode->i_ino;
+
+  err = dir_commit_chunk(page, pos, reclen);
+  if (!err) wufs_dircache_add(dir, name, namelen, dir_pos(page, de));
+  ei->ini_free_hint = pos;
+
+  dir->i_mtime = dir->i_ctime = CURRENT_TIME_SEC;
+  mark_inode_dirty(dir);
+ out_put:
+  dir_put_page(page);
+ out:
+  return err;
+
+ out_unlock:
+  unlock_page(page);
+  goto out_put;
+}
+
 /**
  * wufs_set_link: (utility function)
  * Take an existing "raw" directory entry and force it to link
@@ -510,8 +950,9 @@ void wufs_set_link(wufs_dentry *de, struct page *page,
   err = __wufs_write_begin(NULL, mapping, pos, sbi->sbi_dirsize,
 			   AOP_FLAG_UNINTERRUPTIBLE, &page, NULL);
   if (err == 0) { /* ready: mod and write */
-    /* add link */
-    de->de_ino = inode->i_ino;
+    /* add link (the name, and so any cached position, is unchanged) */
+    dirent_set_ino(sbi, de, inode->i_ino);
+    dirent_set_type(sbi, de, inode->i_mode);
     /* write */
     err = dir_commit_chunk(page, pos, sbi->sbi_dirsize);
   } else {
@@ -560,7 +1001,7 @@ ino_t wufs_inode_by_name(struct dentry *dentry)
 
   if (de) {
     /* get inode and free the page */
-    res = de->de_ino;
+    res = dirent_ino(wufs_sb(dentry->d_sb), de);
     dir_put_page(page);
   }
   return res;
@@ -647,6 +1088,10 @@ static struct page *dir_get_page(struct inode *dir, unsigned long n)
     kmap(page);
     if (!PageUptodate(page))
       goto fail;
+    /* variable length entries are checked once, before they are walked */
+    if (vardir(wufs_sb(dir->i_sb)) && !PageChecked(page) &&
+	!dir_check_page(dir, page))
+      goto fail;
   }
   /* return the page pointer */
   return page;
@@ -658,3 +1103,773 @@ static struct page *dir_get_page(struct inode *dir, unsigned long n)
 }
 
 
+
+/**
+ * dir_check_page: (utility function)
+ * Verify that the variable length entries on page tile each block of the
+ * directory, so they may be walked without further checks.
+ * Returns 1 (and marks the page checked) if they do; 0 otherwise.
+ */
+static int dir_check_page(struct inode *dir, struct page *page)
+{
+  unsigned bs = dir->i_sb->s_blocksize;
+  char *kaddr = (char *)page_address(page);
+  unsigned limit = wufs_last_byte(dir, page->index);
+  unsigned offs, reclen;
+  struct wufs_dirent2 *de;
+  const char *error;
+
+  offs = 0;
+  if (limit & (bs - 1)) {
+    error = "size is not a multiple of the block size";
+    goto bad;
+  }
+  for ( ; offs < limit; offs += reclen) {
+    de = (struct wufs_dirent2 *)(kaddr + offs);
+    reclen = de->de_rec_len;
+    error = "record is too short";
+    if (reclen < WUFS_DIRENT2_SIZE(0)) goto bad;
+    error = "record is misaligned";
+    if (reclen & (WUFS_DIRENT2_ROUND - 1)) goto bad;
+    error = "name is longer than its record";
+    if (reclen < WUFS_DIRENT2_SIZE(de->de_name_len)) goto bad;
+    error = "record crosses a block boundary";
+    if ((offs & ~(bs - 1)) != ((offs + reclen - 1) & ~(bs - 1))) goto bad;
+  }
+  SetPageChecked(page);
+  return 1;
+
+ bad:
+  printk("WUFS: bad directory entry in inode %lu (page %lu, offset %u): %s\n",
+	 dir->i_ino, page->index, offs, error);
+  return 0;
+}
+
+/**
+ * dir_realign: (utility function)
+ * Return the offset of the first variable length entry on kaddr's page at
+ * or after offset, found by walking forward from the start of its block.
+ */
+static unsigned dir_realign(struct inode *dir, char *kaddr, unsigned offset)
+{
+  unsigned p = offset & ~(dir->i_sb->s_blocksize - 1);
+
+  while (p < offset) {
+    unsigned reclen = ((struct wufs_dirent2 *)(kaddr + p))->de_rec_len;
+
+    if (!reclen) break;
+    p += reclen;
+  }
+  return p;
+}
+
+/**
+ * dir_get_block: (utility function)
+ * Map the page holding block blk of the directory; the block's kernel
+ * address is returned through block.
+ */
+static struct page *dir_get_block(struct inode *dir, unsigned long blk,
+				  char **block)
+{
+  int shift = PAGE_CACHE_SHIFT - dir->i_blkbits;
+  struct page *page = dir_get_page(dir, blk >> shift);
+
+  if (!IS_ERR(page))
+    *block = (char *)page_address(page) +
+      ((blk & ((1UL << shift) - 1)) << dir->i_blkbits);
+  return page;
+}
+
+/**
+ * dir_pos: (utility function)
+ * The position, within the directory file, of p on mapped page page.
+ */
+static inline loff_t dir_pos(struct page *page, void *p)
+{
+  return page_offset(page) + ((char *)p - (char *)page_address(page));
+}
+
+/**
+ * dir_prepare_chunk: (utility function)
+ * Lock page and announce a write of len bytes at pos (finished by
+ * dir_commit_chunk).  On failure the page is left unlocked.
+ */
+static int dir_prepare_chunk(struct page *page, loff_t pos, unsigned len)
+{
+  int err;
+
+  lock_page(page);
+  err = __wufs_write_begin(NULL, page->mapping, pos, len,
+			   AOP_FLAG_UNINTERRUPTIBLE, &page, NULL);
+  if (err)
+    unlock_page(page);
+  return err;
+}
+
+/*
+ * Hashed directories (the dir_index feature; see wufs_fs.h).
+ * A name is found by hashing it, searching the root (and, in a two level
+ * index, one node) for the leaf that covers the hash, and scanning that
+ * leaf alone.  A full leaf is split in two by hash, its upper half moving
+ * to a new block at the end of the directory; a full root pushes its
+ * entries down into a node, and a full node is split in two.  Leaves are
+ * never merged.  A full leaf whose names all share one hash is split
+ * anyway, the new leaf marked as continuing the hash (WUFS_DX_CONTINUED);
+ * names with that hash are then sought in each leaf of the run.  Callers
+ * hold the directory's i_mutex, so the index does not change underneath us.
+ * Entries only ever move to the end of the directory, so a readdir that
+ * races with a split may report an entry twice, but never misses one.
+ */
+
+/**
+ * dx_hash: (utility function)
+ * The (32 bit FNV-1a) hash of a file name, less its low bit (which, in an
+ * index entry, marks a continued hash; see wufs_fs.h).
+ */
+static __u32 dx_hash(const char *name, int len)
+{
+  __u32 hash = 2166136261U;
+
+  while (len--) {
+    hash ^= (unsigned char)*name++;
+    hash *= 16777619U;
+  }
+  return hash & ~WUFS_DX_CONTINUED;
+}
+
+/**
+ * dx_is_head: (utility function)
+ * Return true iff h is the head of an index block.
+ */
+static inline int dx_is_head(struct wufs_dx_head *h)
+{
+  return !h->dh_ino && !h->dh_zero && h->dh_magic == WUFS_DX_MAGIC;
+}
+
+/**
+ * dx_root_head: (utility function)
+ * The head of the index in a hashed directory's root block (just after
+ * "." and "..").
+ */
+static inline struct wufs_dx_head *dx_root_head(char *block)
+{
+  return (struct wufs_dx_head *)(block + 2 * WUFS_DIRENTSIZE);
+}
+
+/**
+ * dx_entries: (utility function)
+ * The index entries that follow head h.
+ */
+static inline struct wufs_dx_entry *dx_entries(struct wufs_dx_head *h)
+{
+  return (struct wufs_dx_entry *)(h + 1);
+}
+
+/**
+ * dx_limit: (utility function)
+ * The number of index entries that fit in the root (or in a node).
+ */
+static inline unsigned dx_limit(struct inode *dir, int root)
+{
+  unsigned used = (root ? 3 : 1) * WUFS_DIRENTSIZE;
+
+  return (dir->i_sb->s_blocksize - used) / sizeof(struct wufs_dx_entry);
+}
+
+/**
+ * dx_indexed: (utility function)
+ * Return true iff dir is a hashed directory.  Directories made before the
+ * feature was enabled (or by tools that don't hash) remain linear.
+ * A directory never changes kind, so the answer is kept in ini_indexed;
+ * only the first call (if wufs_make_empty has not set it) reads block 0.
+ */
+static int dx_indexed(struct inode *dir)
+{
+  struct wufs_inode_info *ei = wufs_i(dir);
+  struct page *page;
+  char *block;
+
+  if (ei->ini_indexed >= 0)
+    return ei->ini_indexed;
+  if (!wufs_has_feature(dir->i_sb, WUFS_FEATURE_DIR_INDEX) ||
+      dir->i_size < dir->i_sb->s_blocksize) {
+    ei->ini_indexed = 0;
+    return 0;
+  }
+  page = dir_get_block(dir, 0, &block);
+  if (IS_ERR(page))
+    return 0;
+  ei->ini_indexed = dx_is_head(dx_root_head(block));
+  dir_put_page(page);
+  return ei->ini_indexed;
+}
+
+/**
+ * dx_index_bytes: (utility function)
+ * If p, a dirent slot on mapped page n (at kaddr) of directory dir, is the
+ * head of an index, return the number of bytes from p to the end of its
+ * block (which linear scans must skip); otherwise, 0.
+ */
+static unsigned dx_index_bytes(struct inode *dir, unsigned long n,
+			       char *kaddr, char *p)
+{
+  unsigned long bs = dir->i_sb->s_blocksize;
+  unsigned long off = (n << PAGE_CACHE_SHIFT) + (p - kaddr);
+
+  if (!wufs_has_feature(dir->i_sb, WUFS_FEATURE_DIR_INDEX))
+    return 0;
+  /* heads live at the start of a node, or in the root's third slot */
+  if (off % bs && off != 2 * WUFS_DIRENTSIZE)
+    return 0;
+  if (!dx_is_head((struct wufs_dx_head *)p))
+    return 0;
+  return bs - off % bs;
+}
+
+/**
+ * dx_search: (utility function)
+ * Find the last entry of index block h whose hash is no greater than hash.
+ * (The first entry's hash is never greater.)
+ */
+static struct wufs_dx_entry *dx_search(struct wufs_dx_head *h, __u32 hash)
+{
+  struct wufs_dx_entry *e = dx_entries(h);
+  int lo = 1, hi = h->dh_count, mid;
+
+  while (lo < hi) {
+    mid = (lo + hi) / 2;
+    if (e[mid].dx_hash <= hash) lo = mid + 1;
+    else hi = mid;
+  }
+  return e + lo - 1;
+}
+
+/**
+ * dx_release: (utility function)
+ * Release the pages of the first n frames of a path.
+ */
+static void dx_release(struct dx_frame *frames, int n)
+{
+  while (n--)
+    dir_put_page(frames[n].page);
+}
+
+/**
+ * dx_probe: (utility function)
+ * Walk the index of hashed directory dir toward the leaf that covers hash,
+ * filling in frames (the root, then any node).  The leaf is the block
+ * named by the last frame's entry, at; at is NULL if the root is empty.
+ * Returns the number of frames (to be released with dx_release), or -EIO.
+ */
+static int dx_probe(struct inode *dir, __u32 hash, struct dx_frame *frames)
+{
+  unsigned long nblocks = dir->i_size >> dir->i_blkbits;
+  struct dx_frame *f = frames;
+  struct wufs_dx_head *h;
+  int level = 0, levels;
+
+  f->page = dir_get_block(dir, 0, &f->block);
+  if (IS_ERR(f->page)) return PTR_ERR(f->page);
+  f->head = dx_root_head(f->block);
+  levels = f->head->dh_levels;
+  if (levels > WUFS_DX_LEVELS_MAX) goto bad;
+
+  for (;;) {
+    h = f->head;
+    if (!dx_is_head(h) || h->dh_limit != dx_limit(dir, !level) ||
+	h->dh_count > h->dh_limit)
+      goto bad;
+    if (!h->dh_count) {
+      /* only the root of a new directory may be empty */
+      if (level) goto bad;
+      f->at = NULL;
+      return 1;
+    }
+    f->at = dx_search(h, hash);
+    if (!f->at->dx_block || f->at->dx_block >= nblocks) goto bad;
+    if (level == levels) return level + 1;
+
+    /* descend to the node */
+    f++;
+    level++;
+    f->page = dir_get_block(dir, f[-1].at->dx_block, &f->block);
+    if (IS_ERR(f->page)) {
+      dx_release(frames, level);
+      return PTR_ERR(f->page);
+    }
+    f->head = (struct wufs_dx_head *)f->block;
+  }
+
+ bad:
+  printk("WUFS: bad index in directory %lu on %s\n",
+	 dir->i_ino, dir->i_sb->s_id);
+  dx_release(frames, level + 1);
+  return -EIO;
+}
+
+/**
+ * dx_find_entry: (utility function)
+ * Find the entry named name in hashed directory dir (see wufs_find_entry).
+ */
+static wufs_dentry *dx_find_entry(struct inode *dir,
+				  const char *name, int namelen,
+				  struct page **res_page)
+{
+  struct wufs_sb_info *sbi = wufs_sb(dir->i_sb);
+  struct dx_frame frames[WUFS_DX_LEVELS_MAX+1];
+  __u32 hash = dx_hash(name, namelen);
+  struct page *page;
+  char *block, *p;
+  int n;
+
+  n = dx_probe(dir, hash, frames);
+  if (n < 0) return NULL;
+  if (!frames[n-1].at) goto out;
+
+  /* search the leaf, and any that continue its hash */
+  do {
+    page = dir_get_block(dir, frames[n-1].at->dx_block, &block);
+    if (IS_ERR(page)) break;
+    for (p = block; p < block + dir->i_sb->s_blocksize; p = wufs_next_entry(p, sbi)) {
+      wufs_dentry *de = (wufs_dentry *)p;
+
+      if (de->de_ino && namecompare(namelen, sbi->sbi_namelen, name, de->de_name)) {
+	dx_release(frames, n);
+	*res_page = page;
+	return de;
+      }
+    }
+    dir_put_page(page);
+  } while (dx_next_leaf(dir, frames, n, hash) > 0);
+ out:
+  dx_release(frames, n);
+  return NULL;
+}
+
+/**
+ * dx_add_link: (utility function)
+ * Link name to inode in hashed directory dir (see wufs_add_link).
+ * The name goes in the leaf that covers its hash (or one continuing it),
+ * which is split if full.
+ */
+static int dx_add_link(struct inode *dir, const char *name, int namelen,
+		       struct inode *inode)
+{
+  struct wufs_sb_info *sbi = wufs_sb(dir->i_sb);
+  struct dx_frame frames[WUFS_DX_LEVELS_MAX+1];
+  __u32 hash = dx_hash(name, namelen);
+  struct page *page, *spage;
+  wufs_dentry *de, *slot;
+  char *block, *p;
+  long blk;
+  loff_t pos;
+  int n, err;
+
+  for (;;) {
+    n = dx_probe(dir, hash, frames);
+    if (n < 0) return n;
+
+    if (!frames[n-1].at) {
+      /* a new directory: give the root its first leaf, and try again */
+      blk = dx_append_block(dir, NULL, 0);
+      err = (blk < 0) ? blk : dx_insert(dir, frames, 0, blk);
+      dx_release(frames, n);
+      if (err) return err;
+      continue;
+    }
+
+    /*
+     * Look for a free slot, and make sure the name is new, in the leaf and
+     * any that continue its hash.  spage holds the slot's leaf; page ends
+     * on the last leaf of the run (the one split if none has room).
+     */
+    slot = NULL;
+    spage = NULL;
+    for (;;) {
+      page = dir_get_block(dir, frames[n-1].at->dx_block, &block);
+      if (IS_ERR(page)) {
+	err = PTR_ERR(page);
+	page = NULL;
+	break;
+      }
+      err = 0;
+      for (p = block; p < block + dir->i_sb->s_blocksize; p = wufs_next_entry(p, sbi)) {
+	de = (wufs_dentry *)p;
+	if (!de->de_ino) {
+	  if (!slot) {
+	    slot = de;
+	    spage = page;
+	  }
+	} else if (namecompare(namelen, sbi->sbi_namelen, name, de->de_name)) {
+	  err = -EEXIST;
+	  break;
+	}
+      }
+      if (!err) err = dx_next_leaf(dir, frames, n, hash);
+      if (err <= 0) break;
+      if (page != spage) dir_put_page(page);
+    }
+
+    if (!err && slot) {
+      pos = dir_pos(spage, slot);
+      err = dir_prepare_chunk(spage, pos, sbi->sbi_dirsize);
+      if (!err) {
+	memcpy(slot->de_name, name, namelen);
+	memset(slot->de_name + namelen, 0, sbi->sbi_namelen - namelen);
+	slot->de_ino = inode->i_ino;
+	dirent_set_type(sbi, slot, inode->i_mode);
+	err = dir_commit_chunk(spage, pos, sbi->sbi_dirsize);
+
+	/* update the containing directory's modification time */
+	dir->i_mtime = dir->i_ctime = CURRENT_TIME_SEC;
+	mark_inode_dirty(dir);
+      }
+    } else if (!err) {
+      /* the leaves are full: split the last, and try again */
+      err = dx_split_leaf(dir, frames, n, page, block);
+    }
+    if (page && page != spage) dir_put_page(page);
+    if (spage) dir_put_page(spage);
+    dx_release(frames, n);
+    if (err || slot) return err;
+  }
+}
+
+/**
+ * dx_append_block: (utility function)
+ * Add a block to the end of hashed directory dir, holding the len bytes at
+ * src followed by zeros.  Returns the new block's number, or -errno.
+ */
+static long dx_append_block(struct inode *dir, const void *src, unsigned len)
+{
+  unsigned bs = dir->i_sb->s_blocksize;
+  unsigned long blk = dir->i_size >> dir->i_blkbits;
+  struct page *page;
+  char *block;
+  loff_t pos;
+  int err;
+
+  page = dir_get_block(dir, blk, &block);
+  if (IS_ERR(page)) return PTR_ERR(page);
+  pos = dir_pos(page, block);
+  err = dir_prepare_chunk(page, pos, bs);
+  if (!err) {
+    memset(block, 0, bs);
+    if (len) memcpy(block, src, len);
+    err = dir_commit_chunk(page, pos, bs);
+  }
+  dir_put_page(page);
+  return err ? err : blk;
+}
+
+/**
+ * dx_insert: (utility function)
+ * Add an entry mapping hash to block blk to index block f, just after the
+ * entry followed (or first, if none).  The block must have room.
+ */
+static int dx_insert(struct inode *dir, struct dx_frame *f,
+		     __u32 hash, unsigned long blk)
+{
+  struct wufs_dx_head *h = f->head;
+  struct wufs_dx_entry *e = dx_entries(h);
+  int i = f->at ? f->at - e + 1 : 0;
+  loff_t pos = dir_pos(f->page, f->block);
+  int err;
+
+  err = dir_prepare_chunk(f->page, pos, dir->i_sb->s_blocksize);
+  if (err) return err;
+  memmove(e + i + 1, e + i, (h->dh_count - i) * sizeof(*e));
+  e[i].dx_hash = hash;
+  e[i].dx_block = blk;
+  h->dh_count++;
+  return dir_commit_chunk(f->page, pos, dir->i_sb->s_blocksize);
+}
+
+/**
+ * dx_next_leaf: (utility function)
+ * If the leaf after the one path frames (n long) leads to continues hash
+ * (its entry's hash is hash | WUFS_DX_CONTINUED), move the path to it,
+ * crossing into the next node if need be.
+ * Returns 1 if the path moved, 0 if the run of hash ends here, or -errno.
+ */
+static int dx_next_leaf(struct inode *dir, struct dx_frame *frames, int n,
+			__u32 hash)
+{
+  unsigned long nblocks = dir->i_size >> dir->i_blkbits;
+  struct dx_frame *f = frames + n - 1;
+  struct wufs_dx_head *h;
+  struct wufs_dx_entry *next;
+  struct page *page;
+  char *block;
+
+  if (f->at + 1 < dx_entries(f->head) + f->head->dh_count) {
+    next = f->at + 1;
+    if (next->dx_hash != (hash | WUFS_DX_CONTINUED)) return 0;
+    if (!next->dx_block || next->dx_block >= nblocks) goto bad;
+    f->at = next;
+    return 1;
+  }
+
+  /* the last entry of a node: the run may go on in the next node */
+  if (n == 1 || frames[0].at + 1 == dx_entries(frames[0].head) + frames[0].head->dh_count)
+    return 0;
+  next = frames[0].at + 1;
+  if (next->dx_hash != (hash | WUFS_DX_CONTINUED)) return 0;
+  if (!next->dx_block || next->dx_block >= nblocks) goto bad;
+  page = dir_get_block(dir, next->dx_block, &block);
+  if (IS_ERR(page)) return PTR_ERR(page);
+  h = (struct wufs_dx_head *)block;
+  if (!dx_is_head(h) || h->dh_limit != dx_limit(dir, 0) || !h->dh_count ||
+      h->dh_count > h->dh_limit || !dx_entries(h)[0].dx_block ||
+      dx_entries(h)[0].dx_block >= nblocks) {
+    dir_put_page(page);
+    goto bad;
+  }
+  dir_put_page(f->page);
+  frames[0].at = next;
+  f->page = page;
+  f->block = block;
+  f->head = h;
+  f->at = dx_entries(h);
+  return 1;
+
+ bad:
+  printk("WUFS: bad index in directory %lu on %s\n",
+	 dir->i_ino, dir->i_sb->s_id);
+  return -EIO;
+}
+
+/**
+ * dx_slot_cmp: (utility function)
+ * Order leaf slots by hash (for sort).
+ */
+static int dx_slot_cmp(const void *a, const void *b)
+{
+  __u32 x = ((const struct dx_slot *)a)->hash;
+  __u32 y = ((const struct dx_slot *)b)->hash;
+
+  return (x < y) ? -1 : (x > y);
+}
+
+/**
+ * dx_split_leaf: (utility function)
+ * The leaf at block (on page), at the end of path frames (n long), is
+ * full.  Move the entries with the upper half of its hashes to a new leaf.
+ * If every name in the leaf has one hash, move half of them, and mark the
+ * new leaf as continuing that hash.  If the index has no room for the new
+ * leaf, grow the index instead.  Either way, the caller searches again.
+ * Returns 0, or -errno.
+ */
+static int dx_split_leaf(struct inode *dir, struct dx_frame *frames, int n,
+			 struct page *page, char *block)
+{
+  struct wufs_sb_info *sbi = wufs_sb(dir->i_sb);
+  struct dx_frame *parent = frames + n - 1;
+  unsigned bs = dir->i_sb->s_blocksize, count = bs / sbi->sbi_dirsize;
+  struct dx_slot *map = NULL;
+  char *buf = NULL;
+  wufs_dentry *de;
+  unsigned i, m;
+  __u32 hash;
+  long blk;
+  loff_t pos;
+  int err = 0;
+
+  if (parent->head->dh_count == parent->head->dh_limit)
+    return dx_grow_index(dir, frames, n);
+
+  map = kmalloc(count * sizeof(*map), GFP_NOFS);
+  buf = kmalloc(bs, GFP_NOFS);
+  if (!map || !buf) {
+    err = -ENOMEM;
+    goto out;
+  }
+  /* order the (all live) entries by hash */
+  for (i = 0; i < count; i++) {
+    de = (wufs_dentry *)(block + i * sbi->sbi_dirsize);
+    map[i].hash = dx_hash(de->de_name, strnlen(de->de_name, sbi->sbi_namelen));
+    map[i].slot = i;
+  }
+  sort(map, count, sizeof(*map), dx_slot_cmp, NULL);
+
+  /* split at the median, or the nearest change of hash to it */
+  for (m = count / 2; m < count; m++)
+    if (map[m].hash != map[m-1].hash) break;
+  if (m == count)
+    for (m = count / 2 - 1; m > 0; m--)
+      if (map[m].hash != map[m-1].hash) break;
+  if (m) {
+    hash = map[m].hash;
+  } else {
+    /* one hash throughout: the new leaf continues it */
+    m = count / 2;
+    hash = map[m].hash | WUFS_DX_CONTINUED;
+  }
+
+  /* copy the upper entries to a new leaf, and index it */
+  for (i = m; i < count; i++)
+    memcpy(buf + (i - m) * sbi->sbi_dirsize,
+	   block + map[i].slot * sbi->sbi_dirsize, sbi->sbi_dirsize);
+  blk = dx_append_block(dir, buf, (count - m) * sbi->sbi_dirsize);
+  if (blk < 0) {
+    err = blk;
+    goto out;
+  }
+  err = dx_insert(dir, parent, hash, blk);
+  if (err) goto out;
+
+  /* only now are the copies found first: remove the originals */
+  pos = dir_pos(page, block);
+  err = dir_prepare_chunk(page, pos, bs);
+  if (err) goto out;
+  for (i = m; i < count; i++)
+    memset(block + map[i].slot * sbi->sbi_dirsize, 0, sbi->sbi_dirsize);
+  err = dir_commit_chunk(page, pos, bs);
+
+ out:
+  kfree(buf);
+  kfree(map);
+  return err;
+}
+
+/**
+ * dx_grow_index: (utility function)
+ * The index block at the end of path frames (n long) is full.  If it is
+ * the root, its entries move down to a new node, which the root then
+ * indexes alone.  If it is a node, its upper half moves to a new node,
+ * indexed by the root just after it.
+ * Returns 0, or -errno; -ENOSPC if the root is full of nodes.
+ */
+static int dx_grow_index(struct inode *dir, struct dx_frame *frames, int n)
+{
+  struct dx_frame *f = frames + n - 1;
+  struct wufs_dx_head *h = f->head, *nh;
+  unsigned bs = dir->i_sb->s_blocksize, keep;
+  char *buf;
+  long blk;
+  loff_t pos;
+  int err;
+
+  if (n > 1 && frames[0].head->dh_count == frames[0].head->dh_limit) {
+    printk("WUFS: index of directory %lu on %s is full\n",
+	   dir->i_ino, dir->i_sb->s_id);
+    return -ENOSPC;
+  }
+  /* the root keeps none of its entries; a node keeps half */
+  keep = (n == 1) ? 0 : h->dh_count / 2;
+
+  buf = kmalloc(bs, GFP_NOFS);
+  if (!buf) return -ENOMEM;
+  nh = (struct wufs_dx_head *)buf;
+  memset(nh, 0, sizeof(*nh));
+  nh->dh_magic = WUFS_DX_MAGIC;
+  nh->dh_limit = dx_limit(dir, 0);
+  nh->dh_count = h->dh_count - keep;
+  memcpy(dx_entries(nh), dx_entries(h) + keep,
+	 nh->dh_count * sizeof(struct wufs_dx_entry));
+  blk = dx_append_block(dir, buf, (char *)(dx_entries(nh) + nh->dh_count) - buf);
+  if (blk < 0) {
+    err = blk;
+    goto out;
+  }
+
+  if (n > 1) {
+    /* index the new node (from its first hash), then trim the old one */
+    err = dx_insert(dir, frames, dx_entries(nh)[0].dx_hash, blk);
+    if (err) goto out;
+  }
+  pos = dir_pos(f->page, f->block);
+  err = dir_prepare_chunk(f->page, pos, bs);
+  if (err) goto out;
+  if (n == 1) {
+    h->dh_levels = 1;
+    dx_entries(h)[0].dx_hash = 0;
+    dx_entries(h)[0].dx_block = blk;
+    h->dh_count = 1;
+  } else {
+    h->dh_count = keep;
+  }
+  err = dir_commit_chunk(f->page, pos, bs);
+
+ out:
+  kfree(buf);
+  return err;
+}
+
+/*
+ * Directory name caches (the dircache mount option; see dircache.c).
+ */
+
+/**
+ * dc_build: (utility function)
+ * Give linear directory dir a name cache holding all its names.
+ * Returns 1, or 0 if there was not memory enough.
+ */
+static int dc_build(struct inode *dir)
+{
+  struct wufs_sb_info *sbi = wufs_sb(dir->i_sb);
+  unsigned long n, npages = dir_pages(dir);
+  loff_t pos;
+
+  if (!wufs_dircache_new(dir, dir->i_size / sbi->sbi_dirsize)) return 0;
+  for (n = 0; n < npages; n++) {
+    struct page *page = dir_get_page(dir, n);
+    char *p, *kaddr, *limit;
+
+    if (IS_ERR(page)) goto fail;
+    kaddr = (char *)page_address(page);
+    limit = kaddr + wufs_last_byte(dir, n) - sbi->sbi_dirsize;
+    for (p = kaddr; p <= limit; p = wufs_next_entry(p, sbi)) {
+      if (!dirent_ino(sbi, p)) continue;
+      pos = dir_pos(page, p);
+      if (wufs_dircache_add(dir, dirent_name(sbi, p),
+			    dirent_namelen(sbi, p), pos)) {
+	dir_put_page(page);
+	return 0;		/* (the cache is gone) */
+      }
+    }
+    dir_put_page(page);
+  }
+  return 1;
+
+ fail:
+  /* an incomplete cache would hide names */
+  wufs_dircache_drop(dir);
+  return 0;
+}
+
+/**
+ * dc_find_entry: (utility function)
+ * Find the entry named name in linear directory dir through its name
+ * cache, building the cache if need be (see wufs_find_entry).
+ * Returns ERR_PTR(-ENOENT) if there is no cache to consult.
+ */
+static wufs_dentry *dc_find_entry(struct inode *dir,
+				  const char *name, int namelen,
+				  struct page **res_page)
+{
+  struct wufs_sb_info *sbi = wufs_sb(dir->i_sb);
+  struct page *page;
+  wufs_dentry *de;
+  loff_t pos;
+  int found;
+
+  found = wufs_dircache_lookup(dir, name, namelen, &pos);
+  if (found < 0 && dc_build(dir))
+    found = wufs_dircache_lookup(dir, name, namelen, &pos);
+  if (found <= 0) return found ? ERR_PTR(found) : NULL;
+
+  page = dir_get_page(dir, pos >> PAGE_CACHE_SHIFT);
+  if (IS_ERR(page)) return ERR_PTR(-ENOENT);
+  de = (wufs_dentry *)((char *)page_address(page) + (pos & ~PAGE_CACHE_MASK));
+  if (dirent_ino(sbi, de) && dirent_match(sbi, de, name, namelen)) {
+    *res_page = page;
+    return de;
+  }
+  /* the cache has gone stale (it shouldn't): discard it, and search */
+  dir_put_page(page);
+  printk("WUFS: stale name cache for directory %lu on %s\n",
+	 dir->i_ino, dir->i_sb->s_id);
+  wufs_dircache_drop(dir);
+  return ERR_PTR(-ENOENT);
+}
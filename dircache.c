@@ -0,0 +1,311 @@
+/*
+ * In-memory directory name cache for the Williams Ultra-buntu File System.
+ * (c) 2011, 2015 duane a. bailey
+ */
+
+#include "wufs.h"
+#include <linux/slab.h>
+#include <linux/vmalloc.h>
+#include <linux/mm.h>
+#include <linux/dcache.h>
+
+/**
+ * wufs_dircache_entry:
+ * One cached name, and where its dirent lives in the directory file.
+ * Names may be as long as WUFS_NAMELEN2, so each entry is sized to its name.
+ */
+struct wufs_dircache_entry {
+  struct hlist_node dce_link;		/* on its hash chain */
+  loff_t            dce_pos;		/* position of the dirent */
+  unsigned char     dce_len;		/* length of name */
+  char              dce_name[];
+};
+
+/**
+ * wufs_dircache:
+ * A directory's name cache: a hash table of every name in the directory.
+ * It is either complete, or not present at all, so a name that is not in
+ * the cache is not in the directory.
+ */
+struct wufs_dircache {
+  struct list_head   dc_lru;		/* on dc_lru, most recently used first */
+  struct inode      *dc_dir;		/* the directory */
+  unsigned           dc_count;		/* count of names */
+  unsigned           dc_mask;		/* count of buckets, less one */
+  struct hlist_head *dc_buckets;
+};
+
+/*
+ * Exported routines.
+ */
+int  wufs_dircache_add(struct inode *dir, const char *name, int len,
+		       loff_t pos);
+void wufs_dircache_drop(struct inode *dir);
+void wufs_dircache_exit(void);
+int  wufs_dircache_init(void);
+int  wufs_dircache_lookup(struct inode *dir, const char *name, int len,
+			  loff_t *pos);
+int  wufs_dircache_new(struct inode *dir, unsigned long slots);
+void wufs_dircache_remove(struct inode *dir, const char *name, int len);
+
+/*
+ * Local routines.
+ */
+static struct hlist_head *bucket(struct wufs_dircache *dc,
+				 const char *name, int len);
+static void               dc_free(struct wufs_dircache *dc);
+static int                dc_shrink(int nr_to_scan, gfp_t gfp_mask);
+
+/*
+ * Global variables.
+ */
+/**
+ * dc_lru, dc_lock, dc_entries:
+ * Every cache, in order of use; the lock protecting the list (and each
+ * inode's pointer to its cache, against the shrinker); and the count of
+ * names cached, in all.
+ */
+static LIST_HEAD(dc_lru);
+static DEFINE_SPINLOCK(dc_lock);
+static atomic_t dc_entries = ATOMIC_INIT(0);
+
+/**
+ * dc_shrinker:
+ * Lets the VM reclaim directory caches when memory is short.
+ */
+static struct shrinker dc_shrinker = {
+  .shrink = dc_shrink,
+  .seeks  = DEFAULT_SEEKS,
+};
+
+/*
+ * Code.
+ *
+ * With the dircache mount option, the first wufs_find_entry in a linear
+ * (unhashed) directory builds a cache of all its names (see dir.c); later
+ * lookups then hash the name rather than scan the directory.  All changes
+ * to a directory's names are reflected here.  Callers hold the directory's
+ * i_mutex, as does the shrinker while it frees a cache.
+ */
+
+/**
+ * wufs_dircache_init: (module-wide utility function)
+ * Register the shrinker.
+ */
+int wufs_dircache_init(void)
+{
+  register_shrinker(&dc_shrinker);
+  return 0;
+}
+
+/**
+ * wufs_dircache_exit: (module-wide utility function)
+ * Tear down the name cache (every directory's cache is already gone).
+ */
+void wufs_dircache_exit(void)
+{
+  unregister_shrinker(&dc_shrinker);
+}
+
+/**
+ * bucket: (utility function)
+ * The hash chain for name.
+ */
+static struct hlist_head *bucket(struct wufs_dircache *dc,
+				 const char *name, int len)
+{
+  return dc->dc_buckets + (full_name_hash(name, len) & dc->dc_mask);
+}
+
+/**
+ * wufs_dircache_new: (module-wide utility function)
+ * Give dir an empty cache, sized for a directory of slots entries; the
+ * caller then adds every name.  Returns 1, or 0 if memory is short.
+ */
+int wufs_dircache_new(struct inode *dir, unsigned long slots)
+{
+  struct wufs_dircache *dc;
+  unsigned n = 16, i;
+  size_t size;
+
+  /* about two names per bucket */
+  while (n < slots / 2 && n < (1U << 20)) n <<= 1;
+  size = n * sizeof(struct hlist_head);
+
+  dc = kmalloc(sizeof(*dc), GFP_NOFS);
+  if (!dc) return 0;
+  dc->dc_buckets = (size > PAGE_SIZE) ? vmalloc(size) : kmalloc(size, GFP_NOFS);
+  if (!dc->dc_buckets) {
+    kfree(dc);
+    return 0;
+  }
+  for (i = 0; i < n; i++)
+    INIT_HLIST_HEAD(dc->dc_buckets + i);
+  dc->dc_dir = dir;
+  dc->dc_count = 0;
+  dc->dc_mask = n - 1;
+
+  spin_lock(&dc_lock);
+  wufs_i(dir)->ini_dircache = dc;
+  list_add(&dc->dc_lru, &dc_lru);
+  spin_unlock(&dc_lock);
+  return 1;
+}
+
+/**
+ * wufs_dircache_add: (module-wide utility function)
+ * Note that name's dirent, in dir, is at pos.  If the cache cannot grow,
+ * it is dropped (to be rebuilt, larger, on demand).
+ * Returns 0, or -ENOMEM if the cache was dropped for lack of memory.
+ */
+int wufs_dircache_add(struct inode *dir, const char *name, int len, loff_t pos)
+{
+  struct wufs_dircache *dc = wufs_i(dir)->ini_dircache;
+  struct wufs_dircache_entry *dce;
+
+  if (!dc) return 0;
+  /* crowded: better to rebuild than to chase long chains */
+  if (dc->dc_count >= 4 * (dc->dc_mask + 1)) {
+    wufs_dircache_drop(dir);
+    return 0;
+  }
+  dce = kmalloc(offsetof(struct wufs_dircache_entry, dce_name) + len, GFP_NOFS);
+  if (!dce) {
+    wufs_dircache_drop(dir);
+    return -ENOMEM;
+  }
+  dce->dce_pos = pos;
+  dce->dce_len = len;
+  memcpy(dce->dce_name, name, len);
+  hlist_add_head(&dce->dce_link, bucket(dc, name, len));
+  dc->dc_count++;
+  atomic_inc(&dc_entries);
+  return 0;
+}
+
+/**
+ * wufs_dircache_lookup: (module-wide utility function)
+ * Look for name in dir's cache.
+ * Returns 1 (with the position of its dirent in *pos) if it is there; 0 if
+ * it is not (and so, not in the directory); or -ENOENT if dir has no cache.
+ */
+int wufs_dircache_lookup(struct inode *dir, const char *name, int len,
+			 loff_t *pos)
+{
+  struct wufs_dircache *dc = wufs_i(dir)->ini_dircache;
+  struct wufs_dircache_entry *dce;
+  struct hlist_node *node;
+
+  if (!dc) return -ENOENT;
+
+  /* keep busy directories' caches away from the shrinker */
+  spin_lock(&dc_lock);
+  list_move(&dc->dc_lru, &dc_lru);
+  spin_unlock(&dc_lock);
+
+  hlist_for_each_entry(dce, node, bucket(dc, name, len), dce_link) {
+    if (dce->dce_len == len && !memcmp(dce->dce_name, name, len)) {
+      *pos = dce->dce_pos;
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/**
+ * wufs_dircache_remove: (module-wide utility function)
+ * Forget name (which is being removed from dir).
+ */
+void wufs_dircache_remove(struct inode *dir, const char *name, int len)
+{
+  struct wufs_dircache *dc = wufs_i(dir)->ini_dircache;
+  struct wufs_dircache_entry *dce;
+  struct hlist_node *node;
+
+  if (!dc) return;
+  hlist_for_each_entry(dce, node, bucket(dc, name, len), dce_link) {
+    if (dce->dce_len == len && !memcmp(dce->dce_name, name, len)) {
+      hlist_del(&dce->dce_link);
+      kfree(dce);
+      dc->dc_count--;
+      atomic_dec(&dc_entries);
+      return;
+    }
+  }
+}
+
+/**
+ * wufs_dircache_drop: (module-wide utility function)
+ * Discard dir's cache, if it has one.
+ */
+void wufs_dircache_drop(struct inode *dir)
+{
+  struct wufs_inode_info *ei = wufs_i(dir);
+  struct wufs_dircache *dc;
+
+  spin_lock(&dc_lock);
+  dc = ei->ini_dircache;
+  if (dc) {
+    list_del(&dc->dc_lru);
+    ei->ini_dircache = NULL;
+  }
+  spin_unlock(&dc_lock);
+  if (dc) dc_free(dc);
+}
+
+/**
+ * dc_free: (utility function)
+ * Free a cache that is no longer reachable.
+ */
+static void dc_free(struct wufs_dircache *dc)
+{
+  struct wufs_dircache_entry *dce;
+  struct hlist_node *node, *next;
+  unsigned i;
+
+  for (i = 0; i <= dc->dc_mask; i++) {
+    hlist_for_each_entry_safe(dce, node, next, dc->dc_buckets + i, dce_link)
+      kfree(dce);
+  }
+  atomic_sub(dc->dc_count, &dc_entries);
+  if (is_vmalloc_addr(dc->dc_buckets))
+    vfree(dc->dc_buckets);
+  else
+    kfree(dc->dc_buckets);
+  kfree(dc);
+}
+
+/**
+ * dc_shrink: (shrinker callback)
+ * Free the caches of the least recently used directories, until about
+ * nr_to_scan names are gone.  Directories that are busy (their i_mutex is
+ * held) are passed over.
+ * Returns the (scaled) count of names that remain.
+ */
+static int dc_shrink(int nr_to_scan, gfp_t gfp_mask)
+{
+  struct wufs_dircache *dc, *next;
+  LIST_HEAD(victims);
+
+  if (nr_to_scan) {
+    if (!(gfp_mask & __GFP_FS)) return -1;
+
+    spin_lock(&dc_lock);
+    list_for_each_entry_safe_reverse(dc, next, &dc_lru, dc_lru) {
+      struct inode *dir = dc->dc_dir;
+
+      if (nr_to_scan <= 0) break;
+      if (!mutex_trylock(&dir->i_mutex)) continue;
+      list_move(&dc->dc_lru, &victims);
+      wufs_i(dir)->ini_dircache = NULL;
+      mutex_unlock(&dir->i_mutex);
+      nr_to_scan -= dc->dc_count;
+    }
+    spin_unlock(&dc_lock);
+
+    /* the victims are unreachable; free them without the lock */
+    list_for_each_entry_safe(dc, next, &victims, dc_lru)
+      dc_free(dc);
+  }
+  return (atomic_read(&dc_entries) / 100) * sysctl_vfs_cache_pressure;
+}
@@ -9,7 +9,7 @@
 /*
  * Types.
  */
-typedef __u16 block_t;	/* 16 bit, host order */
+typedef __u32 block_t;	/* in memory, 32 bit, host order */
 
 /*
  * Global routines.
@@ -23,16 +23,7 @@ unsigned wufs_blocks(loff_t size, struct super_block *sb);
  * Local routines.
  */
 static inline               block_t *bptrs(struct inode *inode);
-
-/*
- * Global variables
- */
-
-/**
- * pointers_lock: (read-write lock)
- * Reader/writer lock protecting the inode block pointer access.
- */
-static DEFINE_RWLOCK(pointers_lock);
+static inline              rwlock_t *pointers_lock(struct inode *inode);
 
 /*
  * Code.
@@ -48,60 +39,83 @@ static inline block_t *bptrs(struct inode *inode)
 }
 
 
+/**
+ * pointers_lock: (utility function)
+ * Given an inode, get the reader/writer lock protecting its block pointers.
+ * The lock is per-inode, so writers extending different files never
+ * contend.  Pointers are single aligned words, so lookups that merely read
+ * a pointer (e.g. mapping an allocated block) need not take it at all.
+ */
+static inline rwlock_t *pointers_lock(struct inode *inode)
+{
+  return &wufs_i(inode)->ini_pointers_lock;
+}
+
 /**
  * wufs_get_block: (module-wide utility function)
  * Get the buffer assoicated with a particular block.
- * If create=1, create the block if missing; otherwise return with error
+ * If create=1, create the block if missing; otherwise the block is a hole:
+ * we return 0 and leave bh unmapped, and the caller reads zeros.
+ * When creating, a run of as many blocks as bh->b_size asks for (up to the
+ * next mapped pointer) is claimed in one allocation, and reported in
+ * bh->b_size; an allocated block is mapped alone.
  */
 int wufs_get_blk(struct inode * inode, sector_t block, struct buffer_head *bh, int create)
 {
   /* get the meta-data associated with the file system superblock */
   struct wufs_sb_info *sbi = wufs_sb(inode->i_sb);
   block_t *bptr, *ptr;
+  unsigned long maxblocks, want, got, won, run = 1;
 
   if (block < 0 || block >= sbi->sbi_max_fblks) {
     return -EIO;
   }
 
+  /* the number of blocks the caller is prepared to map (within the inode) */
+  maxblocks = bh->b_size >> inode->i_blkbits;
+  if (!maxblocks) maxblocks = 1;
+  if (maxblocks > WUFS_INODE_BPTRS - block)
+    maxblocks = WUFS_INODE_BPTRS - block;
+
   bptr = bptrs(inode);
   ptr = bptr+block;
   /* now, ensure there's a block reference at the end of the pointer */
  start:
   if (!*ptr) {
-    int n; /* number of any new block */
+    unsigned long n; /* number of the first new block */
 
-    /* if we're not allowed to create it, claim an I/O error */
-    if (!create) return -EIO;
+    /* if we're not allowed to create it, it's a hole: leave bh unmapped */
+    if (!create) return 0;
 
-    /* grab a new block */
-    n = wufs_new_block(inode);
+    /* the length of the hole, up to what the caller asked for */
+    for (want = 1; want < maxblocks && !ptr[want]; want++)
+      ;
+
+    /* grab new blocks, preferably just after the previous one */
+    n = wufs_new_blocks(inode, (block && bptr[block-1]) ? bptr[block-1]+1 : 0,
+			1, want, &got);
     /* not possible? must have run out of space! */
     if (!n) return -ENOSPC;
 
-    /* critical block update section */
-    write_lock(&pointers_lock);
-    if (*ptr) {
-      /* some other thread has set this! yikes: back out */
-      write_unlock(&pointers_lock);
-      /* return block to the pool */
-      wufs_free_block(inode,n);
-      goto start; /* above */
-    } else {
-      /* we're good to modify the block pointer */
-      *ptr = n;
-      /* done with critical path */
-      write_unlock(&pointers_lock);
-
-      /* update time and flush changes to disk */
-      inode->i_mtime = inode->i_ctime = CURRENT_TIME_SEC;
-      mark_inode_dirty(inode);
-
-      /*
-       * tell the buffer system this a new, valid block
-       * (see <linux/include/linux/buffer_head.h>)
-       */
-      set_buffer_new(bh);
-    }
+    /* critical block update section: claim what is still unset */
+    write_lock(pointers_lock(inode));
+    for (won = 0; won < got && !ptr[won]; won++) ptr[won] = n + won;
+    write_unlock(pointers_lock(inode));
+
+    /* return to the pool any blocks some other thread beat us to */
+    if (won < got) wufs_free_blocks(inode, n + won, got - won);
+    if (!won) goto start; /* above */
+    run = won;
+
+    /* update time and flush changes to disk */
+    inode->i_mtime = inode->i_ctime = CURRENT_TIME_SEC;
+    mark_inode_dirty(inode);
+
+    /*
+     * tell the buffer system these are new, valid blocks
+     * (see <linux/include/linux/buffer_head.h>)
+     */
+    set_buffer_new(bh);
   }
 
   /* 
@@ -109,6 +123,8 @@ int wufs_get_blk(struct inode * inode, sector_t block, struct buffer_head *bh, i
    * assign a disk mapping associated with the file system and block number
    */
   map_bh(bh, inode->i_sb, *ptr);
+  /* report just the blocks mapped (direct I/O takes all of b_size) */
+  bh->b_size = run << inode->i_blkbits;
 
   return 0;
 }
@@ -124,11 +140,16 @@ void wufs_truncate(struct inode *inode)
   int i;
   long bcnt;
 
+  /* only these have blocks: a device inode's pointers hold its rdev */
+  if (!(S_ISREG(inode->i_mode) || S_ISDIR(inode->i_mode) ||
+	S_ISLNK(inode->i_mode)))
+    return;
+
   block_truncate_page(inode->i_mapping, inode->i_size, wufs_get_blk);
 
-  write_lock(&pointers_lock);
+  write_lock(pointers_lock(inode));
   /* compute the number of blocks needed by this file */
-  bcnt = (inode->i_size + WUFS_BLOCKSIZE -1) / WUFS_BLOCKSIZE;
+  bcnt = wufs_blocks(inode->i_size, inode->i_sb);
 
   /* set all blocks referenced beyond file size to 0 (null) */
   for (i = bcnt; i < WUFS_INODE_BPTRS; i++) {
@@ -137,7 +158,7 @@ void wufs_truncate(struct inode *inode)
     }
     blk[i] = 0;
   }
-  write_unlock(&pointers_lock);
+  write_unlock(pointers_lock(inode));
 
   /* My what a big change we made!  Timestamp and flush it to disk. */
   inode->i_mtime = inode->i_ctime = CURRENT_TIME_SEC;
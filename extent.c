@@ -0,0 +1,627 @@
+/*
+ * Extent-based block mapping for the Williams Ultimate File System.
+ * Used (in place of indirect.c's pointers) by file systems with the
+ * WUFS_FEATURE_EXTENTS feature.
+ */
+#include <linux/buffer_head.h>
+#include "wufs.h"
+
+/**
+ * ext_path:
+ * One node on the path from the root of an extent tree to a leaf: the
+ * node (bh is NULL for the root, which lives in the inode), and the index
+ * of the entry followed down from it.
+ */
+struct ext_path {
+  struct buffer_head        *bh;
+  struct wufs_extent_header *eh;
+  int                        i;
+};
+
+/*
+ * Global routines.
+ */
+int  wufs_extent_get_blk(struct inode *inode, sector_t block,
+			 struct buffer_head *bh, int create);
+void wufs_extent_truncate(struct inode *inode);
+
+/*
+ * Local routines.
+ */
+static inline struct wufs_extent_header *root_header(struct inode *inode);
+static inline struct wufs_extent        *entries(struct wufs_extent_header *eh);
+static inline int  block_capacity(struct super_block *sb);
+static inline int  capacity(struct inode *inode, struct ext_path *p);
+static inline int  bad_node(struct wufs_extent_header *eh, int cap);
+static int  find_entry(struct wufs_extent_header *eh, unsigned long block);
+static int  walk(struct inode *inode, unsigned long block,
+		 struct ext_path *path);
+static void release_path(struct ext_path *path, int depth);
+static void dirty_node(struct inode *inode, struct ext_path *p);
+static int  lookup(struct inode *inode, unsigned long block,
+		   struct wufs_extent *ex, unsigned long *goal,
+		   unsigned long *next);
+static int  add_to_leaf(struct wufs_extent_header *eh, int cap,
+			unsigned long block, unsigned long lba,
+			unsigned long len);
+static int  grow_tree(struct inode *inode);
+static int  split_node(struct inode *inode, struct ext_path *parent,
+		       struct buffer_head *bh);
+static int  insert_extent(struct inode *inode, unsigned long block,
+			  unsigned long lba, unsigned long len);
+static void trim_leaf(struct inode *inode, struct wufs_extent_header *eh,
+		      unsigned long bcnt);
+static int  trim_node(struct inode *inode, struct wufs_extent_header *eh,
+		      int cap, unsigned long bcnt);
+
+/*
+ * Code.
+ *
+ * A file's extent tree (see wufs_fs.h) is rooted in the block pointer area
+ * of its inode.  The root holds either extents or entries that index
+ * extent blocks, which in turn hold extents (leaves) or index deeper
+ * blocks.  The first entry of every index covers the first block its node
+ * covers (block 0, for the root), so every block belongs to exactly one
+ * leaf.  A full node is split into two, adding an entry to its parent; a
+ * full root moves its entries down into a new block, deepening the tree.
+ * The whole tree is protected by the inode's ini_extent_sem: mappings
+ * share it, and changes to the tree (allocation, truncation) hold it
+ * exclusively.
+ */
+
+/**
+ * root_header: (utility function)
+ * The root of the inode's extent tree (held in its block pointers).
+ */
+static inline struct wufs_extent_header *root_header(struct inode *inode)
+{
+  return (struct wufs_extent_header *)wufs_i(inode)->ini_data;
+}
+
+/**
+ * entries: (utility function)
+ * The array of entries that follows an extent header.
+ */
+static inline struct wufs_extent *entries(struct wufs_extent_header *eh)
+{
+  return (struct wufs_extent *)(eh + 1);
+}
+
+/**
+ * block_capacity: (utility function)
+ * The number of entries held by an extent block.
+ */
+static inline int block_capacity(struct super_block *sb)
+{
+  return (sb->s_blocksize - sizeof(struct wufs_extent_header)) /
+    sizeof(struct wufs_extent);
+}
+
+/**
+ * find_entry: (utility function)
+ * Binary search for the last entry of eh that begins at or before block.
+ * Returns its index, or -1 if every entry begins after block.
+ * The header must already be checked (see bad_node, walk).
+ */
+static int find_entry(struct wufs_extent_header *eh, unsigned long block)
+{
+  struct wufs_extent *ex = entries(eh);
+  int lo = 0, hi = eh->eh_entries, mid;
+
+  /* invariant: entries before lo begin at or before block; from hi, after */
+  while (lo < hi) {
+    mid = (lo + hi) / 2;
+    if (ex[mid].ex_lblk <= block) lo = mid + 1;
+    else hi = mid;
+  }
+  return lo - 1;
+}
+
+/**
+ * capacity: (utility function)
+ * The number of entries the node p can hold.
+ */
+static inline int capacity(struct inode *inode, struct ext_path *p)
+{
+  return p->bh ? block_capacity(inode->i_sb) : WUFS_INODE_EXTENTS;
+}
+
+/**
+ * bad_node: (utility function)
+ * Check the header of a node that holds at most cap entries, read from
+ * disk, before its entries are searched: a count past the end of the node,
+ * a depth past WUFS_EXTENT_DEPTH_MAX, or an empty index means corruption.
+ * Returns nonzero if the header is bad.
+ */
+static inline int bad_node(struct wufs_extent_header *eh, int cap)
+{
+  return eh->eh_entries > cap || eh->eh_depth > WUFS_EXTENT_DEPTH_MAX ||
+    (eh->eh_depth && !eh->eh_entries);
+}
+
+/**
+ * walk: (utility function)
+ * Read the path from the root of the extent tree down to the leaf that
+ * covers file block block: path[0] is the root, path[depth] the leaf.
+ * Returns the depth of the tree, or -EIO.  On success, the caller releases
+ * the path (release_path).
+ * Caller must hold ini_extent_sem.
+ */
+static int walk(struct inode *inode, unsigned long block,
+		struct ext_path *path)
+{
+  struct wufs_extent_header *eh = root_header(inode);
+  struct buffer_head *bh;
+  int k, i, depth = eh->eh_depth;
+
+  path[0].bh = NULL;
+  path[0].eh = eh;
+  if (bad_node(eh, WUFS_INODE_EXTENTS)) goto bad;
+  for (k = 0; k < depth; k++) {
+    /* (an index's first entry covers its node's first block) */
+    i = find_entry(path[k].eh, block);
+    if (i < 0) i = 0;
+    path[k].i = i;
+    bh = sb_bread(inode->i_sb, entries(path[k].eh)[i].ex_start);
+    if (!bh) {
+      release_path(path, k);
+      return -EIO;
+    }
+    path[k+1].bh = bh;
+    path[k+1].eh = (struct wufs_extent_header *)bh->b_data;
+    if (bad_node(path[k+1].eh, block_capacity(inode->i_sb)) ||
+	path[k+1].eh->eh_depth != depth - k - 1) {
+      release_path(path, k + 1);
+      goto bad;
+    }
+  }
+  return depth;
+
+ bad:
+  printk("WUFS: corrupt extent tree in inode %lu on %s\n",
+	 inode->i_ino, inode->i_sb->s_id);
+  return -EIO;
+}
+
+/**
+ * release_path: (utility function)
+ * Release the blocks of a path read by walk.
+ */
+static void release_path(struct ext_path *path, int depth)
+{
+  int k;
+
+  for (k = 1; k <= depth; k++)
+    brelse(path[k].bh);
+}
+
+/**
+ * dirty_node: (utility function)
+ * Note that node p has changed: the root is written with its inode, other
+ * nodes with the inode's buffers.
+ */
+static void dirty_node(struct inode *inode, struct ext_path *p)
+{
+  if (p->bh) mark_buffer_dirty_inode(p->bh, inode);
+  else mark_inode_dirty(inode);
+}
+
+/**
+ * lookup: (utility function)
+ * Find the extent that maps file block block.
+ * Returns 1, with the extent in *ex, if it is mapped; 0 if it is not (in
+ * which case *goal suggests where to put it: just where the preceding
+ * extent would extend to, and no block from block up to *next is mapped);
+ * or -EIO.
+ * Caller must hold ini_extent_sem.
+ */
+static int lookup(struct inode *inode, unsigned long block,
+		  struct wufs_extent *ex, unsigned long *goal,
+		  unsigned long *next)
+{
+  struct ext_path path[WUFS_EXTENT_DEPTH_MAX + 1];
+  struct wufs_extent_header *eh;
+  struct wufs_extent *prev;
+  int i, k, depth, found = 0;
+
+  *goal = 0;
+  *next = ~0UL;
+  depth = walk(inode, block, path);
+  if (depth < 0) return depth;
+  eh = path[depth].eh;
+
+  i = find_entry(eh, block);
+  if (i >= 0) {
+    prev = entries(eh) + i;
+    if (block < prev->ex_lblk + prev->ex_len) {
+      *ex = *prev;
+      found = 1;
+    } else {
+      *goal = prev->ex_start + (block - prev->ex_lblk);
+    }
+  }
+  /* the hole ends at the next extent: in this leaf, or a later one */
+  if (i + 1 < eh->eh_entries) {
+    *next = entries(eh)[i+1].ex_lblk;
+  } else {
+    for (k = depth - 1; k >= 0; k--) {
+      if (path[k].i + 1 < path[k].eh->eh_entries) {
+	*next = entries(path[k].eh)[path[k].i + 1].ex_lblk;
+	break;
+      }
+    }
+  }
+  release_path(path, depth);
+  return found;
+}
+
+/**
+ * wufs_extent_get_blk: (module-wide utility function)
+ * Map file block block (see wufs_get_blk), by extent.
+ * An allocated block is mapped along with the rest of its extent (as much
+ * as bh->b_size allows).  When creating, a run of as many blocks as
+ * bh->b_size asks for (up to the next mapped block) is claimed in one
+ * allocation, and recorded as one extent (merged into its neighbors when
+ * contiguous); bh->b_size reports the length of the run actually claimed.
+ */
+int wufs_extent_get_blk(struct inode *inode, sector_t block,
+			struct buffer_head *bh, int create)
+{
+  struct super_block *sb = inode->i_sb;
+  struct wufs_sb_info *sbi = wufs_sb(sb);
+  struct wufs_inode_info *ei = wufs_i(inode);
+  struct wufs_extent ex;
+  unsigned long maxblocks, goal, next, lba, run;
+  int found, err = 0;
+
+  /* the number of blocks the caller is prepared to map */
+  maxblocks = bh->b_size >> inode->i_blkbits;
+  if (!maxblocks) maxblocks = 1;
+  if (maxblocks > sbi->sbi_max_fblks - block)
+    maxblocks = sbi->sbi_max_fblks - block;
+
+  /* the common case: the block is already mapped */
+  down_read(&ei->ini_extent_sem);
+  found = lookup(inode, block, &ex, &goal, &next);
+  up_read(&ei->ini_extent_sem);
+  if (found < 0) return found;
+
+  if (!found) {
+    /* if we're not allowed to create it, it's a hole: leave bh unmapped */
+    if (!create) return 0;
+
+    down_write(&ei->ini_extent_sem);
+    /* some other thread may have mapped it in the meantime */
+    found = lookup(inode, block, &ex, &goal, &next);
+    if (found) {
+      up_write(&ei->ini_extent_sem);
+      if (found < 0) return found;
+    } else {
+      /* fill as much of the hole as the caller asked for... */
+      if (maxblocks > next - block) maxblocks = next - block;
+      /* ...in one run; not possible? must have run out of space! */
+      lba = wufs_new_blocks(inode, goal, 1, maxblocks, &run);
+      if (!lba) {
+	err = -ENOSPC;
+      } else if ((err = insert_extent(inode, block, lba, run))) {
+	/* no room for the tree (or it is broken): return run to the pool */
+	wufs_free_blocks(inode, lba, run);
+      }
+      up_write(&ei->ini_extent_sem);
+      if (err) return err;
+
+      /* update time and flush changes to disk */
+      inode->i_mtime = inode->i_ctime = CURRENT_TIME_SEC;
+      mark_inode_dirty(inode);
+
+      /*
+       * tell the buffer system this a new, valid block
+       * (see <linux/include/linux/buffer_head.h>)
+       */
+      set_buffer_new(bh);
+      map_bh(bh, sb, lba);
+      /* only the run is ours: callers (e.g. direct I/O) asking for more
+       * must not take the blocks after it */
+      bh->b_size = run << inode->i_blkbits;
+      return 0;
+    }
+  }
+
+  /* map the block, along with the rest of its extent */
+  run = min(maxblocks, (unsigned long)(ex.ex_len - (block - ex.ex_lblk)));
+  map_bh(bh, sb, ex.ex_start + (block - ex.ex_lblk));
+  bh->b_size = run << inode->i_blkbits;
+  return 0;
+}
+
+/**
+ * add_to_leaf: (utility function)
+ * Record that the len file blocks from block are mapped to the disk blocks
+ * from lba in the extents of eh (which holds at most cap entries).  The run
+ * extends (or joins) neighboring extents if it is contiguous with them;
+ * otherwise it becomes a new extent of its own.
+ * Returns 0, or -ENOSPC if a new extent is needed but eh is full.
+ */
+static int add_to_leaf(struct wufs_extent_header *eh, int cap,
+		       unsigned long block, unsigned long lba,
+		       unsigned long len)
+{
+  struct wufs_extent *ex = entries(eh);
+  int i = find_entry(eh, block), n = eh->eh_entries;
+
+  /* append to the preceding extent? (and perhaps join the following one) */
+  if (i >= 0 && ex[i].ex_lblk + ex[i].ex_len == block &&
+      ex[i].ex_start + ex[i].ex_len == lba) {
+    ex[i].ex_len += len;
+    if (i + 1 < n && ex[i+1].ex_lblk == block + len &&
+	ex[i+1].ex_start == lba + len) {
+      ex[i].ex_len += ex[i+1].ex_len;
+      memmove(ex + i + 1, ex + i + 2, (n - i - 2) * sizeof(*ex));
+      eh->eh_entries--;
+    }
+    return 0;
+  }
+
+  /* prepend to the following extent? */
+  if (i + 1 < n && ex[i+1].ex_lblk == block + len &&
+      ex[i+1].ex_start == lba + len) {
+    ex[i+1].ex_lblk -= len;
+    ex[i+1].ex_start -= len;
+    ex[i+1].ex_len += len;
+    return 0;
+  }
+
+  /* a new extent, in order */
+  if (n == cap) return -ENOSPC;
+  memmove(ex + i + 2, ex + i + 1, (n - i - 1) * sizeof(*ex));
+  ex[i+1].ex_lblk = block;
+  ex[i+1].ex_start = lba;
+  ex[i+1].ex_len = len;
+  eh->eh_entries++;
+  return 0;
+}
+
+/**
+ * grow_tree: (utility function)
+ * The inode's root is full: move its entries into a new block, and make the
+ * root an index with that block as its only entry.
+ * Returns 0, or -ENOSPC or -EIO, or -EFBIG if the tree is already
+ * WUFS_EXTENT_DEPTH_MAX deep (more extents than any file can need).
+ */
+static int grow_tree(struct inode *inode)
+{
+  struct wufs_extent_header *root = root_header(inode);
+  struct wufs_extent_header *eh;
+  struct buffer_head *bh;
+  unsigned long lba;
+
+  if (root->eh_depth >= WUFS_EXTENT_DEPTH_MAX) return -EFBIG;
+
+  /* allocate the new block near the data it maps */
+  lba = wufs_new_block(inode, root->eh_entries ? entries(root)[0].ex_start : 0);
+  if (!lba) return -ENOSPC;
+  bh = sb_getblk(inode->i_sb, lba);
+  if (!bh) {
+    wufs_free_block(inode, lba);
+    return -EIO;
+  }
+
+  /* fill it before the root refers to it */
+  lock_buffer(bh);
+  memset(bh->b_data, 0, bh->b_size);
+  eh = (struct wufs_extent_header *)bh->b_data;
+  eh->eh_depth = root->eh_depth;
+  eh->eh_entries = root->eh_entries;
+  memcpy(entries(eh), entries(root), root->eh_entries * sizeof(struct wufs_extent));
+  set_buffer_uptodate(bh);
+  unlock_buffer(bh);
+  mark_buffer_dirty_inode(bh, inode);
+  brelse(bh);
+
+  /* the first index entry covers the file from block 0 */
+  root->eh_depth++;
+  root->eh_entries = 1;
+  entries(root)[0].ex_lblk = 0;
+  entries(root)[0].ex_start = lba;
+  entries(root)[0].ex_len = 0;
+  mark_inode_dirty(inode);
+  return 0;
+}
+
+/**
+ * split_node: (utility function)
+ * The block held by bh (a leaf or an index), entry parent->i of the node
+ * parent, is full: move its upper half into a new block of the same depth,
+ * indexed just after it.  The parent must have room for the new entry.
+ * Returns 0, or -ENOSPC or -EIO.
+ */
+static int split_node(struct inode *inode, struct ext_path *parent,
+		      struct buffer_head *bh)
+{
+  struct wufs_extent_header *eh = (struct wufs_extent_header *)bh->b_data;
+  struct wufs_extent_header *neh;
+  struct wufs_extent *idx = entries(parent->eh);
+  struct buffer_head *nbh;
+  unsigned long lba;
+  int i = parent->i, half = eh->eh_entries / 2;
+
+  lba = wufs_new_block(inode, bh->b_blocknr + 1);
+  if (!lba) return -ENOSPC;
+  nbh = sb_getblk(inode->i_sb, lba);
+  if (!nbh) {
+    wufs_free_block(inode, lba);
+    return -EIO;
+  }
+
+  /* fill the new block with the upper half */
+  lock_buffer(nbh);
+  memset(nbh->b_data, 0, nbh->b_size);
+  neh = (struct wufs_extent_header *)nbh->b_data;
+  neh->eh_depth = eh->eh_depth;
+  neh->eh_entries = eh->eh_entries - half;
+  memcpy(entries(neh), entries(eh) + half, neh->eh_entries * sizeof(struct wufs_extent));
+  set_buffer_uptodate(nbh);
+  unlock_buffer(nbh);
+  mark_buffer_dirty_inode(nbh, inode);
+
+  /* index it, just after the old block */
+  memmove(idx + i + 2, idx + i + 1, (parent->eh->eh_entries - i - 1) * sizeof(*idx));
+  idx[i+1].ex_lblk = entries(neh)[0].ex_lblk;
+  idx[i+1].ex_start = lba;
+  idx[i+1].ex_len = 0;
+  parent->eh->eh_entries++;
+  dirty_node(inode, parent);
+  brelse(nbh);
+
+  /* the old block keeps the lower half */
+  eh->eh_entries = half;
+  mark_buffer_dirty_inode(bh, inode);
+  return 0;
+}
+
+/**
+ * insert_extent: (utility function)
+ * Record the new mapping of the len file blocks from block to the disk
+ * blocks from lba in the extent tree.  If the leaf is full, the lowest
+ * full node on its path with a parent that has room is split (or, if every
+ * node on the path is full, the tree grows a level), and the insertion is
+ * tried again.
+ * Returns 0, or -ENOSPC if no block is free for the tree itself, -EFBIG
+ * (see grow_tree), or -EIO.
+ * Caller must hold ini_extent_sem exclusively.
+ */
+static int insert_extent(struct inode *inode, unsigned long block,
+			 unsigned long lba, unsigned long len)
+{
+  struct ext_path path[WUFS_EXTENT_DEPTH_MAX + 1];
+  int k, depth, err;
+
+  for (;;) {
+    depth = walk(inode, block, path);
+    if (depth < 0) return depth;
+    if (!add_to_leaf(path[depth].eh, capacity(inode, path + depth),
+		     block, lba, len)) {
+      dirty_node(inode, path + depth);
+      release_path(path, depth);
+      return 0;
+    }
+    /* the leaf is full: find the deepest node above it with room */
+    for (k = depth - 1; k >= 0; k--)
+      if (path[k].eh->eh_entries < capacity(inode, path + k)) break;
+    if (k < 0) err = grow_tree(inode);
+    else err = split_node(inode, path + k, path[k+1].bh);
+    release_path(path, depth);
+    if (err) return err;
+  }
+}
+
+/**
+ * trim_leaf: (utility function)
+ * Free the blocks of the extents of eh that map file blocks from bcnt on,
+ * shortening or removing those extents.  (trim_node checks eh first.)
+ */
+static void trim_leaf(struct inode *inode, struct wufs_extent_header *eh,
+		      unsigned long bcnt)
+{
+  struct wufs_extent *ex;
+  unsigned long keep;
+
+  while (eh->eh_entries) {
+    ex = entries(eh) + eh->eh_entries - 1;
+    if (ex->ex_lblk + ex->ex_len <= bcnt) break;
+    if (ex->ex_lblk >= bcnt) {
+      /* the whole extent goes */
+      wufs_free_blocks(inode, ex->ex_start, ex->ex_len);
+      eh->eh_entries--;
+    } else {
+      /* the extent straddles the new end of file */
+      keep = bcnt - ex->ex_lblk;
+      wufs_free_blocks(inode, ex->ex_start + keep, ex->ex_len - keep);
+      ex->ex_len = keep;
+      break;
+    }
+  }
+}
+
+/**
+ * trim_node: (utility function)
+ * Free the blocks mapped by node eh (which holds at most cap entries) from
+ * file block bcnt on, along with any extent blocks below eh left empty.
+ * Returns 0, or -EIO if the tree is unreadable or corrupt (trimming stops
+ * there, leaking the blocks below rather than freeing blocks in use).
+ */
+static int trim_node(struct inode *inode, struct wufs_extent_header *eh,
+		     int cap, unsigned long bcnt)
+{
+  struct wufs_extent_header *ceh;
+  struct wufs_extent *idx;
+  struct buffer_head *bh;
+  int i, err;
+
+  if (bad_node(eh, cap)) {
+    printk("WUFS: corrupt extent tree in inode %lu on %s\n",
+	   inode->i_ino, inode->i_sb->s_id);
+    return -EIO;
+  }
+  if (!eh->eh_depth) {
+    trim_leaf(inode, eh, bcnt);
+    return 0;
+  }
+
+  /* work back from the last child */
+  for (i = eh->eh_entries - 1; i >= 0; i--) {
+    idx = entries(eh) + i;
+    bh = sb_bread(inode->i_sb, idx->ex_start);
+    if (!bh) {
+      printk("WUFS: unable to read extent block %u on %s\n",
+	     idx->ex_start, inode->i_sb->s_id);
+      return -EIO;
+    }
+    ceh = (struct wufs_extent_header *)bh->b_data;
+    if (ceh->eh_depth != eh->eh_depth - 1) {
+      printk("WUFS: corrupt extent tree in inode %lu on %s\n",
+	     inode->i_ino, inode->i_sb->s_id);
+      brelse(bh);
+      return -EIO;
+    }
+    err = trim_node(inode, ceh, block_capacity(inode->i_sb), bcnt);
+    if (!err && !ceh->eh_entries) {
+      /* an empty child (the last) goes, too */
+      bforget(bh);
+      wufs_free_block(inode, idx->ex_start);
+      eh->eh_entries--;
+    } else {
+      mark_buffer_dirty_inode(bh, inode);
+      brelse(bh);
+    }
+    if (err) return err;
+    /* earlier children map only blocks before this one */
+    if (idx->ex_lblk < bcnt) break;
+  }
+  return 0;
+}
+
+/**
+ * wufs_extent_truncate: (module-wide utility function)
+ * Set the allocation of an extent-mapped file to exactly match its size
+ * (see wufs_truncate).  Whole extents are freed as ranges.
+ */
+void wufs_extent_truncate(struct inode *inode)
+{
+  struct wufs_inode_info *ei = wufs_i(inode);
+  struct wufs_extent_header *root = root_header(inode);
+  unsigned long bcnt;
+
+  /* compute the number of blocks needed by this file */
+  bcnt = wufs_blocks(inode->i_size, inode->i_sb);
+
+  down_write(&ei->ini_extent_sem);
+  /* with no extent blocks left, the root holds extents again */
+  if (!trim_node(inode, root, WUFS_INODE_EXTENTS, bcnt) && !root->eh_entries)
+    root->eh_depth = 0;
+  up_write(&ei->ini_extent_sem);
+
+  /* My what a big change we made!  Timestamp and flush it to disk. */
+  inode->i_mtime = inode->i_ctime = CURRENT_TIME_SEC;
+  mark_inode_dirty(inode);
+}
@@ -82,7 +82,7 @@ int wufs_getattr(struct vfsmount *mnt, struct dentry *dentry, struct kstat *stat
   generic_fillattr(dentry->d_inode, stat);
 
   /* ...but report the block count in device blocks (not 512-byte blocks) */
-  stat->blocks = (WUFS_BLOCKSIZE / 512) * wufs_blocks(stat->size, sb);
+  stat->blocks = (sb->s_blocksize / 512) * wufs_blocks(stat->size, sb);
   stat->blksize = sb->s_blocksize;
   return 0;
 }
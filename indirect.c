@@ -3,20 +3,22 @@
  * (c) 2011, 2015 duane a. bailey, Reid Pryzant, Tony Liu
  */
 #include <linux/buffer_head.h>
+#include <linux/slab.h>
 #include "wufs.h"
 
 /*
  * Types.
  */
-typedef __u16 block_t;	/* 16 bit, host order */
+typedef __u32 block_t;	/* in memory, 32 bit, host order */
 
 /*
  * Global routines.
  */
-int      wufs_get_blk(struct inode * inode, sector_t block,
+int           wufs_get_blk(struct inode * inode, sector_t block,
 			   struct buffer_head *bh_result, int create);
-void     wufs_truncate(struct inode * inode);
-unsigned wufs_blocks(loff_t size, struct super_block *sb);
+void          wufs_truncate(struct inode * inode);
+unsigned      wufs_blocks(loff_t size, struct super_block *sb);
+unsigned long wufs_max_blocks(struct super_block *sb);
 
 
 
@@ -24,219 +26,512 @@ unsigned wufs_blocks(loff_t size, struct super_block *sb);
  * Local routines.
  */
 static inline               block_t *bptrs(struct inode *inode);
-static int retrieve_indirect(block_t *ptr, struct inode *inode, int create, struct buffer_head *bh, sector_t block);
-static int retrieve_direct(block_t *ptr, struct inode *inode, int create, struct buffer_head *bh);
+static inline              rwlock_t *pointers_lock(struct inode *inode);
+static inline unsigned long ptrs_per_block(struct super_block *sb);
+static inline int           ptr_wide(struct super_block *sb);
+static inline block_t       get_ptr(void *ptrs, int wide, unsigned long i);
+static inline void          set_ptr(void *ptrs, int wide, unsigned long i, block_t lba);
+static int  block_to_path(struct inode *inode, unsigned long block,
+			  int offsets[WUFS_MAX_DEPTH+1]);
+static unsigned long find_goal(void *ptrs, int wide, int n, unsigned long fallback);
+static unsigned long run_length(void *ptrs, int wide, unsigned long i, unsigned long max);
+static unsigned long hole_length(void *ptrs, int wide, unsigned long i, unsigned long max);
+static long cached_indirect(struct inode *inode, unsigned long base, unsigned long i, unsigned long max, unsigned long *run);
+static void fill_indirect_cache(struct inode *inode, unsigned long base, struct buffer_head *leaf);
+static void drop_indirect_cache(struct inode *inode);
+static unsigned long install(struct inode *inode, struct buffer_head *parent, unsigned long i, block_t lba, unsigned long n);
+static void trim_tree(struct inode *inode, unsigned long lba, int depth, unsigned long from);
 
-static int debug = 1;
-#define debugPrint if (debug) printk
+/*
+ * Code.
+ *
+ * A file's block pointers (in the inode) begin with sbi_ndirect direct
+ * pointers.  Each of the remaining sbi_depth pointers is the root of a tree
+ * of indirect blocks: the first is single indirect (a block of pointers to
+ * data), the next (from version 2) double indirect, and so on.  A block of
+ * pointers that refers directly to data is a "leaf"; one leaf per inode is
+ * cached in memory, so mapping blocks past the direct range is usually as
+ * cheap as mapping a direct block.
+ * On disk, pointers are 16 bits wide through version 2, and 32 bits wide
+ * from version 3.  In memory (the inode's pointers, and the cached leaf)
+ * they are always 32 bits.
+ */
 
+/**
+ * bptrs: (utility function)
+ * Given an inode, get the array of block pointers
+ */
+static inline block_t *bptrs(struct inode *inode)
+{
+  return (block_t *)wufs_i(inode)->ini_data;
+}
 
-/*
- * Global variables
+
+/**
+ * pointers_lock: (utility function)
+ * Given an inode, get the reader/writer lock protecting its block pointers.
+ * The lock is per-inode, so writers extending different files never
+ * contend.  Pointers are single aligned words, so lookups that merely read
+ * a pointer (e.g. mapping an allocated block) need not take it at all.
  */
+static inline rwlock_t *pointers_lock(struct inode *inode)
+{
+  return &wufs_i(inode)->ini_pointers_lock;
+}
 
 /**
- * pointers_lock: (read-write lock)
- * Reader/writer lock protecting the inode block pointer access.
+ * ptrs_per_block: (utility function)
+ * The number of block pointers held by an indirect block.
  */
-static DEFINE_RWLOCK(pointers_lock);
+static inline unsigned long ptrs_per_block(struct super_block *sb)
+{
+  return sb->s_blocksize / wufs_sb(sb)->sbi_ptrsize;
+}
 
-/*
- * Code.
+/**
+ * ptr_wide: (utility function)
+ * Whether this file system's indirect blocks hold 32 (rather than 16) bit
+ * pointers.
  */
+static inline int ptr_wide(struct super_block *sb)
+{
+  return wufs_sb(sb)->sbi_ptrsize == sizeof(__u32);
+}
 
 /**
- * bptrs: (utility function)
- * Given an inode, get the array of block pointers
+ * get_ptr: (utility function)
+ * Fetch entry i of the pointer array ptrs, of 32 bit (wide) or 16 bit
+ * entries.
  */
-static inline block_t *bptrs(struct inode *inode)
+static inline block_t get_ptr(void *ptrs, int wide, unsigned long i)
 {
-  return (block_t *)wufs_i(inode)->ini_data;
+  return wide ? ((__u32 *)ptrs)[i] : ((__u16 *)ptrs)[i];
+}
+
+/**
+ * set_ptr: (utility function)
+ * Store lba as entry i of the pointer array ptrs (see get_ptr).
+ */
+static inline void set_ptr(void *ptrs, int wide, unsigned long i, block_t lba)
+{
+  if (wide) ((__u32 *)ptrs)[i] = lba;
+  else ((__u16 *)ptrs)[i] = lba;
+}
+
+/**
+ * wufs_max_blocks: (module-wide utility function)
+ * The number of blocks that the inode pointer geometry of this file
+ * system's version can map.
+ */
+unsigned long wufs_max_blocks(struct super_block *sb)
+{
+  struct wufs_sb_info *sbi = wufs_sb(sb);
+  unsigned long span = 1, total = sbi->sbi_ndirect;
+  int level;
+
+  for (level = 1; level <= sbi->sbi_depth; level++) {
+    span *= ptrs_per_block(sb);
+    total += span;
+  }
+  return total;
 }
 
+/**
+ * block_to_path: (utility function)
+ * Translate file block number block into the path of pointer offsets that
+ * leads to it: offsets[0] indexes the inode's pointer array, and
+ * offsets[1..] index successive indirect blocks.
+ * Returns the length of the path (1 for direct blocks), or 0 if the block
+ * is beyond the reach of the pointers.
+ */
+static int block_to_path(struct inode *inode, unsigned long block,
+			 int offsets[WUFS_MAX_DEPTH+1])
+{
+  struct wufs_sb_info *sbi = wufs_sb(inode->i_sb);
+  unsigned long ppb = ptrs_per_block(inode->i_sb);
+  unsigned long span = 1;
+  int level, i;
+
+  if (block < sbi->sbi_ndirect) {
+    offsets[0] = block;
+    return 1;
+  }
+  block -= sbi->sbi_ndirect;
+
+  /* find the tree covering block; each maps ppb times more than the last */
+  for (level = 1; level <= sbi->sbi_depth; level++) {
+    span *= ppb;
+    if (block < span) break;
+    block -= span;
+  }
+  if (level > sbi->sbi_depth) return 0;
+
+  /* the tree's root pointer, followed by an index at each level */
+  offsets[0] = sbi->sbi_ndirect + level - 1;
+  for (i = level; i > 0; i--) {
+    offsets[i] = block % ppb;
+    block /= ppb;
+  }
+  return level + 1;
+}
 
 /**
  * wufs_get_block: (module-wide utility function)
  * Get the buffer associated with a particular block.
- * If create=1, create the block if missing; otherwise return with error
+ * If create=1, create the block if missing; otherwise the block is a hole:
+ * we return 0 and leave bh unmapped, and the caller reads zeros.
+ * The caller may ask for as many as bh->b_size bytes to be mapped.  If the
+ * block is already allocated, we map the whole run of physically
+ * contiguous blocks that follows it (up to that size, and never beyond the
+ * pointer array holding it), and report its length in bh->b_size.
+ * When creating, a run of as many data blocks as bh->b_size asks for (up to
+ * the next mapped entry of the same pointer array) is claimed in one
+ * allocation; bh->b_size reports the length of the run actually claimed.
  */
 int wufs_get_blk(struct inode * inode, sector_t block, struct buffer_head *bh, int create)
 {
   /* get the meta-data associated with the file system superblock */
-  struct wufs_sb_info *sbi = wufs_sb(inode->i_sb);
-  block_t *bptr, *ptr;
+  struct super_block *sb = inode->i_sb;
+  struct wufs_sb_info *sbi = wufs_sb(sb);
+  struct buffer_head *parent = NULL, *next;
+  int offsets[WUFS_MAX_DEPTH+1];
+  void *ptrs;
+  unsigned long maxblocks, base = 0, run = 1, goal, want, got, won;
+  long lba;
+  int depth, k, wide, new = 0, err = 0;
 
   if (block < 0 || block >= sbi->sbi_max_fblks) {
     return -EIO;
   }
+  /* files may instead be mapped by extents (see extent.c) */
+  if (wufs_has_feature(sb, WUFS_FEATURE_EXTENTS))
+    return wufs_extent_get_blk(inode, block, bh, create);
+  depth = block_to_path(inode, block, offsets);
+  if (!depth) return -EIO;
+
+  /* the number of blocks the caller is prepared to map (within the array) */
+  maxblocks = bh->b_size >> inode->i_blkbits;
+  if (!maxblocks) maxblocks = 1;
+  if (maxblocks > sbi->sbi_max_fblks - block)
+    maxblocks = sbi->sbi_max_fblks - block;
+  if (depth == 1)
+    maxblocks = min(maxblocks, (unsigned long)(sbi->sbi_ndirect - block));
+  else
+    maxblocks = min(maxblocks, ptrs_per_block(sb) - offsets[depth-1]);
+
+  /* the common case: the block (and its run) is mapped in the cached leaf */
+  if (depth > 1) {
+    base = block - offsets[depth-1];
+    lba = cached_indirect(inode, base, offsets[depth-1], maxblocks, &run);
+    if (lba > 0) goto map;
+    if (!lba && !create) return 0;	/* a hole */
+  }
+
+  /*
+   * Walk the path from the inode, allocating any missing blocks (indirect
+   * or data) as we go.  New blocks are placed just after their predecessor
+   * in the same pointer array, or just after the array's own block.
+   */
+  ptrs = bptrs(inode);
+  wide = 1;
+  for (k = 0; ; k++) {
+    while (!get_ptr(ptrs, wide, offsets[k])) {
+      struct buffer_head *nbh = NULL;
+
+      /* if we're not allowed to create it, it's a hole: leave bh unmapped */
+      if (!create) { lba = 0; goto out; }
 
-  bptr = bptrs(inode);
+      /*
+       * grab a new block (or, for data, a run filling as much of the hole
+       * as the caller asked for); not possible? must have run out of space!
+       */
+      goal = find_goal(ptrs, wide, offsets[k], parent ? parent->b_blocknr + 1 : 0);
+      want = (k < depth-1) ? 1 : hole_length(ptrs, wide, offsets[k], maxblocks);
+      lba = wufs_new_blocks(inode, goal, 1, want, &got);
+      if (!lba) { err = -ENOSPC; goto out; }
+
+      if (k < depth-1) {
+	/* a new indirect block: get a buffer for it, and zero it */
+	nbh = sb_getblk(sb, lba);
+	if (!nbh) {
+	  wufs_free_block(inode, lba);
+	  err = -EIO;
+	  goto out;
+	}
+	lock_buffer(nbh);
+	memset(nbh->b_data, 0, nbh->b_size);
+	set_buffer_uptodate(nbh);
+	unlock_buffer(nbh);
+      }
 
-  //WUFS_INODE_BPTRS-1 is 7, index of the indirect ptr
-  if(block >= WUFS_INODE_BPTRS-1) {
-    ptr = bptr+WUFS_INODE_BPTRS-1;
-    block -= WUFS_INODE_BPTRS-1; //SHOULD THIS BE WITHOUT -1?
-    debugPrint("getting indirect block %d\n", (int)block);
-    return retrieve_indirect(ptr, inode, create, bh, block);
+      won = install(inode, parent, offsets[k], lba, got);
+      if (won) {
+	if (nbh) {
+	  mark_buffer_dirty_inode(nbh, inode);
+	  brelse(nbh);
+	} else {
+	  /*
+	   * tell the buffer system these are new, valid blocks
+	   * (see <linux/include/linux/buffer_head.h>)
+	   */
+	  set_buffer_new(bh);
+	  new = 1;
+	  run = won;
+	}
+      } else if (nbh) {
+	/* some other thread has set this! yikes: back out */
+	bforget(nbh);
+      }
+      /* return to the pool any blocks another thread beat us to */
+      if (won < got) wufs_free_blocks(inode, lba + won, got - won);
+    }
+    if (k == depth-1) break;
+
+    /* descend to the next level of indirection */
+    next = sb_bread(sb, get_ptr(ptrs, wide, offsets[k]));
+    if (!next) { err = -EIO; goto out; }
+    brelse(parent);
+    parent = next;
+    ptrs = parent->b_data;
+    wide = ptr_wide(sb);
   }
-  else {
-    ptr = bptr+block;
-    return retrieve_direct(ptr, inode, create, bh);
+
+  /* at this point, the pointer is non-zero */
+  lba = get_ptr(ptrs, wide, offsets[k]);
+  if (parent) {
+    /* remember this leaf for next time */
+    fill_indirect_cache(inode, base, parent);
   }
+  if (!new) run = run_length(ptrs, wide, offsets[k], maxblocks);
 
+ out:
+  /* release indirection bufferhead */
+  brelse(parent);
+  if (err || !lba) return err;
+ map:
+  /*
+   * assign a disk mapping associated with the file system and block number
+   */
+  map_bh(bh, sb, lba);
+  bh->b_size = run << inode->i_blkbits;
   return 0;
 }
 
 /**
- * direct block retrieval (same as Duane's original code)
+ * find_goal: (utility function)
+ * Suggest a disk location for the n-th entry of the pointer array ptrs:
+ * just beyond the closest mapped block that precedes it, or fallback
+ * if there is none (0 lets the allocator choose).
  */
-int retrieve_direct(block_t *ptr, struct inode *inode, int create, struct buffer_head *bh) {
-  /* now, ensure there's a block reference at the end of the pointer */
- start:
-  if (!*ptr) {
-    int n; /* number of any new block */
-    
-    /* if we're not allowed to create it, claim an I/O error */
-    if (!create) return -EIO;
-    
-    /* grab a new block */
-    n = wufs_new_block(inode);
-    /* not possible? must have run out of space! */
-    if (!n) return -ENOSPC;
+static unsigned long find_goal(void *ptrs, int wide, int n, unsigned long fallback)
+{
+  while (n-- > 0)
+    if (get_ptr(ptrs, wide, n)) return get_ptr(ptrs, wide, n) + 1;
+  return fallback;
+}
+
+/**
+ * run_length: (utility function)
+ * Count the entries of ptrs, beginning with entry i (a mapped block), that
+ * refer to physically consecutive blocks; at most max are considered.
+ */
+static unsigned long run_length(void *ptrs, int wide, unsigned long i, unsigned long max)
+{
+  block_t first = get_ptr(ptrs, wide, i);
+  unsigned long n = 1;
+  while (n < max && get_ptr(ptrs, wide, i + n) == first + n) n++;
+  return n;
+}
+
+/**
+ * hole_length: (utility function)
+ * Count the entries of ptrs, beginning with entry i (an unmapped block),
+ * that are unmapped; at most max are considered.
+ */
+static unsigned long hole_length(void *ptrs, int wide, unsigned long i, unsigned long max)
+{
+  unsigned long n = 1;
+  while (n < max && !get_ptr(ptrs, wide, i + n)) n++;
+  return n;
+}
+
+/**
+ * install: (utility function)
+ * Store the pointers lba, lba+1, ... (at most n of them) as entries i,
+ * i+1, ..., stopping at the first entry another thread got to first.
+ * The entries live either in the inode (parent is NULL; the pointers lock
+ * protects them) or in the indirect block held by parent (the buffer lock
+ * protects them).  New data pointers are written through to the cached
+ * leaf.
+ * Returns the number of pointers installed: 0 if entry i was already set.
+ */
+static unsigned long install(struct inode *inode, struct buffer_head *parent,
+			     unsigned long i, block_t lba, unsigned long n)
+{
+  struct wufs_inode_info *ei = wufs_i(inode);
+  block_t *slot = bptrs(inode) + i;
+  unsigned long won, k;
+  int wide;
 
+  if (!parent) {
     /* critical block update section */
-    write_lock(&pointers_lock);
-    if (*ptr) {
-      /* some other thread has set this! yikes: back out */
-      write_unlock(&pointers_lock);
-      /* return block to the pool */
-      wufs_free_block(inode,n);
-      goto start; /* above */
-    } else {
-      /* we're good to modify the block pointer */
-      *ptr = n;
-      /* done with critical path */
-      write_unlock(&pointers_lock);
-      
-      /* update time and flush changes to disk */
-      inode->i_mtime = inode->i_ctime = CURRENT_TIME_SEC;
-      mark_inode_dirty(inode);
-      
-      /*
-       * tell the buffer system this a new, valid block
-       * (see <linux/include/linux/buffer_head.h>)
-       */
-      set_buffer_new(bh);
-    }
+    write_lock(pointers_lock(inode));
+    for (won = 0; won < n && !slot[won]; won++) slot[won] = lba + won;
+    write_unlock(pointers_lock(inode));
+    if (!won) return 0;
+
+    /* update time and flush changes to disk */
+    inode->i_mtime = inode->i_ctime = CURRENT_TIME_SEC;
+    mark_inode_dirty(inode);
+    return won;
   }
 
-  /* 
-   * at this point, *ptr is non-zero
-   * assign a disk mapping associated with the file system and block number
-   */
-  map_bh(bh, inode->i_sb, *ptr);
-  return 0;
+  wide = ptr_wide(inode->i_sb);
+  lock_buffer(parent);
+  for (won = 0; won < n && !get_ptr(parent->b_data, wide, i + won); won++)
+    set_ptr(parent->b_data, wide, i + won, lba + won);
+  unlock_buffer(parent);
+  if (!won) return 0;
+
+  /* ...and write them through to the cached copy of this leaf, if any */
+  write_lock(pointers_lock(inode));
+  if (ei->ini_indirect && ei->ini_indirect_lba == parent->b_blocknr)
+    for (k = 0; k < won; k++) ei->ini_indirect[i + k] = lba + k;
+  write_unlock(pointers_lock(inode));
+
+  /* mark the indirection bh as dirty */
+  mark_buffer_dirty_inode(parent, inode);
+  return won;
+}
+
+/**
+ * cached_indirect: (utility function)
+ * Look up entry i of the leaf that maps file blocks from base onward in
+ * the inode's cached copy of a leaf.  The copy is protected by the
+ * pointers lock; allocation writes through to it, and truncation
+ * discards it.
+ * Returns the entry (0 if unmapped), with the length of the contiguous run
+ * that begins there (at most max) in *run, or -ENOENT if that leaf is not
+ * the one cached.
+ */
+static long cached_indirect(struct inode *inode, unsigned long base, unsigned long i, unsigned long max, unsigned long *run)
+{
+  struct wufs_inode_info *ei = wufs_i(inode);
+  long lba = -ENOENT;
+
+  read_lock(pointers_lock(inode));
+  if (ei->ini_indirect && ei->ini_indirect_base == base) {
+    lba = ei->ini_indirect[i];
+    *run = lba ? run_length(ei->ini_indirect, 1, i, max) : 0;
+  }
+  read_unlock(pointers_lock(inode));
+  return lba;
 }
 
 /**
- * indirect block retrieval oh boy
+ * fill_indirect_cache: (utility function)
+ * Make the leaf block held by buffer leaf, which maps file blocks from base
+ * onward, the inode's cached leaf.  (If memory is short, we simply don't.)
+ * If it is already cached, write through has kept the copy current.
+ * The copy is decoded to 32 bit pointers.
  */
-int retrieve_indirect(block_t *ptr, struct inode *inode, int create, struct buffer_head *bh, sector_t block) {
-  // initialize block to be mapped to outgoing bh
-  int data_LBA;
-  int i;
- start:
-  //case when indirect block is not allocated: allocates indirect block
-  if (!*ptr) {
-    int indirect_LBA; /* number of our new indirect block */
-    struct buffer_head *indir_ptr;
-    block_t *blk_data;
-    /* if we're not allowed to create it, claim an I/O error */
-    if (!create) return -EIO;
-    
-    /* grab a new block */
-    indirect_LBA = wufs_new_block(inode);
-    /* not possible? must have run out of space! */
-    if (!indirect_LBA) return -ENOSPC;
- 
-    /* get a buffer head associated with the indirect block. Worry: int?  */
-    indir_ptr = sb_getblk(inode->i_sb, indirect_LBA); 
- 
-    blk_data = (block_t *)indir_ptr->b_data; 
-    set_buffer_new(indir_ptr);  
-    map_bh(indir_ptr, inode->i_sb, indirect_LBA); 
-    
-    //Time to write to ptr
-    write_lock(&pointers_lock);
-    if (*ptr) {
-      /* some other thread has set this! yikes: back out */
-      write_unlock(&pointers_lock);
-      /* need to forget that bh we allocated */
-      bforget(indir_ptr);
-      /* return blocks to the pool */
-      wufs_free_block(inode,indirect_LBA);
-      wufs_free_block(inode,data_LBA);
-      goto start; /* above */
+static void fill_indirect_cache(struct inode *inode, unsigned long base, struct buffer_head *leaf)
+{
+  struct wufs_inode_info *ei = wufs_i(inode);
+  unsigned long i, ppb = ptrs_per_block(inode->i_sb);
+  int wide = ptr_wide(inode->i_sb);
+  block_t *copy = NULL;
+
+  if (!ei->ini_indirect) copy = kmalloc(ppb * sizeof(block_t), GFP_NOFS);
+
+  write_lock(pointers_lock(inode));
+  if (!ei->ini_indirect && copy) {
+    ei->ini_indirect = copy;
+    ei->ini_indirect_lba = 0;	/* (no leaf lives at lba 0) */
+    copy = NULL;
+  }
+  if (ei->ini_indirect && (ei->ini_indirect_base != base ||
+			   ei->ini_indirect_lba != leaf->b_blocknr)) {
+    /* copying under the lock orders us with allocation's write through */
+    for (i = 0; i < ppb; i++)
+      ei->ini_indirect[i] = get_ptr(leaf->b_data, wide, i);
+    ei->ini_indirect_base = base;
+    ei->ini_indirect_lba = leaf->b_blocknr;
+  }
+  write_unlock(pointers_lock(inode));
+  kfree(copy);			/* (lost a race to allocate the cache) */
+}
+
+/**
+ * drop_indirect_cache: (utility function)
+ * Discard the inode's cached copy of a leaf.
+ */
+static void drop_indirect_cache(struct inode *inode)
+{
+  struct wufs_inode_info *ei = wufs_i(inode);
+  block_t *copy;
+
+  write_lock(pointers_lock(inode));
+  copy = ei->ini_indirect;
+  ei->ini_indirect = NULL;
+  write_unlock(pointers_lock(inode));
+  kfree(copy);
+}
+
+/**
+ * trim_tree: (utility function)
+ * Free the blocks of the depth-level indirect tree rooted at lba that map
+ * file blocks from (counted from the tree's first block) onward.  When
+ * from is 0, the whole tree, including the block at lba, is freed; the
+ * caller must already have cleared its pointer to lba.
+ */
+static void trim_tree(struct inode *inode, unsigned long lba, int depth, unsigned long from)
+{
+  struct super_block *sb = inode->i_sb;
+  unsigned long ppb = ptrs_per_block(sb);
+  unsigned long span = 1, i, first, sub, p;
+  struct buffer_head *bh;
+  void *ptrs;
+  int k, wide = ptr_wide(sb);
+
+  /* the number of file blocks mapped by each entry of this block */
+  for (k = 1; k < depth; k++) span *= ppb;
+
+  bh = sb_bread(sb, lba);
+  if (!bh) {
+    printk("WUFS: unable to read indirect block %lu on %s\n", lba, sb->s_id);
+    return;
+  }
+  ptrs = bh->b_data;
+
+  lock_buffer(bh);
+  first = from / span;
+  for (i = first; i < ppb; i++) {
+    p = get_ptr(ptrs, wide, i);
+    if (!p) continue;
+    /* the first entry may be only partly truncated */
+    sub = (i == first) ? from % span : 0;
+    if (depth == 1) {
+      set_ptr(ptrs, wide, i, 0);
+      wufs_free_block(inode, p);
+    } else {
+      if (!sub) set_ptr(ptrs, wide, i, 0);
+      trim_tree(inode, p, depth - 1, sub);
     }
-    
-    else {
-     /* we're good to modify  the block pointer */
-      *ptr = indirect_LBA;
-      /* done with critical path */
-      write_unlock(&pointers_lock);
- 
-      //we mark the indir_ptr bh as dirty
-      mark_buffer_dirty_inode(indir_ptr, inode);
-      brelse(indir_ptr);     
-
-      /* update time and flush changes to disk */
-      inode->i_mtime = inode->i_ctime = CURRENT_TIME_SEC;
-      mark_inode_dirty(inode);
-    }  
   }
-  // once we're here, *ptr exists, as does the indirection block   
-  struct buffer_head *indir_ptr = sb_bread(inode->i_sb, *ptr);     
-  block_t *blk_data = (block_t *)indir_ptr->b_data;
-  blk_data += block;
-
- start_indirection:  
-  // create new datablock, mark indirection block as dirty          
-  if (!*blk_data) {
-    data_LBA = wufs_new_block(inode);
-    if (!data_LBA) return -ENOSPC;
-    
-    lock_buffer(indir_ptr);
-    // time to write to the indirection block
-    if (*blk_data) {
-      // some other thread has set this! Yikes! back out
-      unlock_buffer(indir_ptr);
-      wufs_free_block(inode, data_LBA);
-      goto start_indirection;      
-    } 
-    else {
-      // we're good to insert the new data block pointer into the indirection block
-      *blk_data = data_LBA;
-      unlock_buffer(indir_ptr);
-      // mark the indirection bh as dirty
-      mark_buffer_dirty_inode(indir_ptr, inode);
-      // release indirection bufferhead
-      brelse(indir_ptr);
-    } 
-  } 
-  // retrieve existing datablock (the nicest case = just retrieve indirect lba)    
-  else {
-    data_LBA = *blk_data;
+  unlock_buffer(bh);
+
+  if (!from) {
+    /* the block itself goes: no need to write it */
+    bforget(bh);
+    wufs_free_block(inode, lba);
+  } else {
+    /* this in mem version of the indirect block needs to be written to disk */
+    mark_buffer_dirty_inode(bh, inode);
+    brelse(bh);
   }
-  
-  /*
-   * tell the buffer system this a new, valid block
-   * (see <linux/include/linux/buffer_head.h>)
-   */
-  set_buffer_new(bh);
-  // map data lba to outgoing bh
-  map_bh(bh, inode->i_sb, data_LBA); 
-  return 0;
 }
+
 /**
  * wufs_truncate: (module-wide utility function)
  * Set the file allocation to exactly match the size of the file.
@@ -244,86 +539,68 @@ int retrieve_indirect(block_t *ptr, struct inode *inode, int create, struct buff
  */
 void wufs_truncate(struct inode *inode)
 {
+  struct wufs_sb_info *sbi = wufs_sb(inode->i_sb);
+  unsigned long ppb = ptrs_per_block(inode->i_sb);
   block_t *blk = bptrs(inode);
-  int i;
-  long bcnt = 0;
+  block_t victims[WUFS_INODE32_BPTRS];
+  unsigned long roots[WUFS_MAX_DEPTH], from[WUFS_MAX_DEPTH];
+  unsigned long bcnt, first, span = 1;
+  int i, level, nvictims = 0;
+
+  /* only these have blocks: a device inode's pointers hold its rdev */
+  if (!(S_ISREG(inode->i_mode) || S_ISDIR(inode->i_mode) ||
+	S_ISLNK(inode->i_mode)))
+    return;
 
   block_truncate_page(inode->i_mapping, inode->i_size, wufs_get_blk);
+  if (wufs_has_feature(inode->i_sb, WUFS_FEATURE_EXTENTS)) {
+    wufs_extent_truncate(inode);
+    return;
+  }
 
-  write_lock(&pointers_lock);
   /* compute the number of blocks needed by this file */
-  bcnt = (inode->i_size + WUFS_BLOCKSIZE - 1) / WUFS_BLOCKSIZE;
-
-  if(bcnt < WUFS_INODE_BPTRS) {
-    int indirect_LBA;
-    struct buffer_head *indir_ptr;
-    block_t *blk_data;
-    /* set all blocks referenced beyond file size to 0 (null) */
-    for (i = bcnt; i < WUFS_INODE_BPTRS-1; i++) {
-      if (blk[i]) {
-	debugPrint("Removing direct block %d\n", i);
-	wufs_free_block(inode,blk[i]);
-      }
-      blk[i] = 0;
-    }
-    write_unlock(&pointers_lock);
-    
-    // wipe out indirection if necessary 
-    indirect_LBA = blk[WUFS_INODE_BPTRS-1];
-
-    debugPrint("The indirect block is: %d\n", indirect_LBA);
-
-    if(indirect_LBA){ //grab indirect LBA
-      indir_ptr = sb_bread(inode->i_sb, indirect_LBA); 
-      blk_data = (block_t *)indir_ptr->b_data;
-      
-      debugPrint("Block data index 0 is %d\n", blk_data[0]);
-
-      for (i = 0; i < WUFS_BLOCKSIZE / 2; i++) { //LBAS are 2 bytes
-	if(blk_data[i]) {
-	  debugPrint("Removing indirect block %d\n", i);
-	  wufs_free_block(inode,blk_data[i]);
-	}
-	blk_data[i] = 0; //because we're polite?
-      }
-      
-      //free the indirect ptr block itself
-      //in and out fast
-      write_lock(&pointers_lock);
-      debugPrint("Removing lvl 1 indirection block\n");
-      blk[WUFS_INODE_BPTRS-1] = 0;
-      write_unlock(&pointers_lock);
-
-      wufs_free_block(inode, indirect_LBA);
-      bforget(indir_ptr); 
-    }
-  } 
-
-  else {
-    write_unlock(&pointers_lock);
-    //we have to enter our indirect blocks
-    bcnt -= (WUFS_INODE_BPTRS-1); //-1 for correct semantics (bcnt is logical size)
-
-    int indirect_LBA = blk[WUFS_INODE_BPTRS-1]; //grab indirect LBA
-    struct buffer_head *indir_ptr = sb_bread(inode->i_sb, indirect_LBA); 
-    block_t *blk_data = (block_t *)indir_ptr->b_data;
-    lock_buffer(indir_ptr);
-    for (i = bcnt; i < WUFS_BLOCKSIZE / 2; i++) { //LBAS are 2 bytes
-      if(blk_data[i]) {
-	wufs_free_block(inode,blk_data[i]);
-      }
-      blk_data[i] = 0;
+  bcnt = wufs_blocks(inode->i_size, inode->i_sb);
+
+  write_lock(pointers_lock(inode));
+  /* set all direct blocks referenced beyond file size to 0 (null) */
+  for (i = bcnt; i < sbi->sbi_ndirect; i++) {
+    if (blk[i]) victims[nvictims++] = blk[i];
+    blk[i] = 0;
+  }
+  /* find the part of each indirect tree beyond file size */
+  first = sbi->sbi_ndirect;
+  for (level = 1; level <= sbi->sbi_depth; level++) {
+    block_t *root = blk + sbi->sbi_ndirect + level - 1;
+    span *= ppb;
+    roots[level-1] = *root;
+    from[level-1] = (bcnt > first) ? bcnt - first : 0;
+    if (from[level-1] >= span) {
+      /* the whole tree is within the file */
+      roots[level-1] = 0;
+    } else if (!from[level-1]) {
+      /* the whole tree goes: detach it */
+      *root = 0;
     }
-    unlock_buffer(indir_ptr);
+    first += span;
+  }
+  write_unlock(pointers_lock(inode));
+  /*
+   * forget the cached leaf before its blocks go (pages beyond the new size
+   * are already gone, so no reader will bring it back)
+   */
+  drop_indirect_cache(inode);
 
-    //this in mem version of the indirect block needs to be written to disk
-    mark_buffer_dirty_inode(indir_ptr, inode);
-    brelse(indir_ptr);
+  /* freeing reads the bitmap (and may sleep), so do it unlocked */
+  for (i = 0; i < nvictims; i++) {
+    wufs_free_block(inode,victims[i]);
+  }
+  for (level = 1; level <= sbi->sbi_depth; level++) {
+    if (roots[level-1]) trim_tree(inode, roots[level-1], level, from[level-1]);
   }
 
   /* My what a big change we made!  Timestamp and flush it to disk. */
   inode->i_mtime = inode->i_ctime = CURRENT_TIME_SEC;
-  mark_inode_dirty(inode);  
+  mark_inode_dirty(inode);
 }
 
 /**
@@ -7,10 +7,12 @@
 #include <linux/module.h>
 #include "wufs.h"
 #include <linux/buffer_head.h>
+#include <linux/mpage.h>
 #include <linux/slab.h>
 #include <linux/init.h>
 #include <linux/highuid.h>
 #include <linux/vfs.h>
+#include <linux/parser.h>
 
 /*
  * Global routines
@@ -30,16 +32,25 @@ static void                destroy_inodecache(void);
 
 static sector_t 	   wufs_bmap(struct address_space *mapping,
 				     sector_t block);
+static ssize_t             wufs_direct_IO(int rw, struct kiocb *iocb,
+					  const struct iovec *iov,
+					  loff_t offset, unsigned long nr_segs);
 static struct inode       *wufs_alloc_inode(struct super_block *sb);
 static void                wufs_delete_inode(struct inode *inode);
 static void                wufs_destroy_inode(struct inode *inode);
 static int		   wufs_fill_super(struct super_block *s, void *data, int silent);
+static void                wufs_mount_readahead(struct super_block *s);
+static int                 parse_options(char *options, unsigned long *opt);
 static int                 wufs_get_sb(struct file_system_type *fs_type,
 				       int flags, const char *dev_name,
 				       void *data, struct vfsmount *mnt);
 static struct inode       *wufs_iget0(struct inode *inode);
 static void		   wufs_put_super(struct super_block *sb);
 static int		   wufs_readpage(struct file *file, struct page *page);
+static int		   wufs_readpages(struct file *file,
+					  struct address_space *mapping,
+					  struct list_head *pages,
+					  unsigned nr_pages);
 static int                 wufs_remount (struct super_block * sb,
 					 int * flags, char * data);
 static int                 wufs_statfs(struct dentry *dentry,
@@ -48,6 +59,8 @@ static struct buffer_head *wufs_update_inode(struct inode * inode);
 static int                 wufs_write_inode(struct inode * inode, int wait);
 static int                 wufs_writepage(struct page *page,
 					  struct writeback_control *wbc);
+static int                 wufs_writepages(struct address_space *mapping,
+					   struct writeback_control *wbc);
 
 static int                 wufs_write_begin(struct file *file,
 					    struct address_space *mapping,
@@ -72,6 +85,18 @@ static struct file_system_type wufs_fs_type = {
   .fs_flags	= FS_REQUIRES_DEV,  /* this system requires a block device */
 };
 
+/**
+ * tokens:
+ * The mount options understood by WUFS (see parse_options).
+ */
+enum { Opt_dircache, Opt_nodircache, Opt_err };
+
+static const match_table_t tokens = {
+  {Opt_dircache,	"dircache"},	/* cache names of linear directories */
+  {Opt_nodircache,	"nodircache"},
+  {Opt_err,		NULL}
+};
+
 /**
  * wufs_inode_cachep:
  * The kernel slab cache that holds wufs inode info structures
@@ -99,11 +124,14 @@ static const struct super_operations wufs_sops = {
  */
 static const struct address_space_operations wufs_aops = {
   .readpage    = wufs_readpage,
+  .readpages   = wufs_readpages,
   .writepage   = wufs_writepage,
+  .writepages  = wufs_writepages,
   .sync_page   = block_sync_page,
   .write_begin = wufs_write_begin,
   .write_end   = generic_write_end,
-  .bmap        = wufs_bmap
+  .bmap        = wufs_bmap,
+  .direct_IO   = wufs_direct_IO
 };
 
 
@@ -115,7 +143,7 @@ static const struct address_space_operations wufs_aops = {
 /**
  * init_wufs_fs:
  * This module initialization routine called when the module is first loaded:
- *  1. allocate a cache for inodes.
+ *  1. allocate a cache for inodes (and for directory names).
  *  2. register this module as supporting a new filesystem.
  * This method is identified by the __init keyword and a reference at the
  * bottom of this file.
@@ -125,10 +153,16 @@ static int __init init_wufs_fs(void)
   /* allocate the cache */
   int err = init_inodecache();
   if (err) return err;
+  err = wufs_dircache_init();
+  if (err) {
+    destroy_inodecache();
+    return err;
+  }
 
   /* register the filesystem */
   err = register_filesystem(&wufs_fs_type);
   if (err) {
+    wufs_dircache_exit();
     destroy_inodecache();
     return err;
   }
@@ -144,6 +178,7 @@ static int __init init_wufs_fs(void)
 static void __exit exit_wufs_fs(void)
 {
   unregister_filesystem(&wufs_fs_type);
+  wufs_dircache_exit();
   destroy_inodecache();
   printk("WUFS: filesystem module unloaded.\n");
 }
@@ -184,6 +219,9 @@ static void init_once(void *foo)
   /* inode info maintains a reference to the vfs inode, which must be inited */
   struct wufs_inode_info *ei = (struct wufs_inode_info *) foo;
 
+  /* the block pointer lock survives reuse of the slab object */
+  rwlock_init(&ei->ini_pointers_lock);
+  init_rwsem(&ei->ini_extent_sem);
   inode_init_once(&ei->ini_vfs_inode);
 }
 
@@ -204,6 +242,53 @@ static int wufs_get_sb(struct file_system_type *fs_type,
   return get_sb_bdev(fs_type, flags, dev_name, data, wufs_fill_super, mnt);
 }
 
+/*
+ * Mount-time readahead covers the inode map and this many blocks of the
+ * inode table (which hold the root inode and other early lookups).
+ */
+#define WUFS_MOUNT_ITABLE_RA 4
+#define WUFS_MOUNT_RA_MAX    32	/* buffers submitted per batch */
+
+/**
+ * wufs_mount_readahead: (local utility)
+ * Start reads of the metadata the mount (and the first few operations)
+ * will need: the inode map, which setup_igroups (see bitmap.c) streams
+ * through, and the first blocks of the inode table.  All are submitted
+ * together, in batches of contiguous blocks that the block layer merges
+ * into a few large requests, rather than one synchronous round trip per
+ * block.  The block map is skipped: its blocks are read on demand, as the
+ * allocator first touches each group.  Nothing is waited on here; later
+ * sb_bread calls find the buffers in the cache, or wait only on their own
+ * I/O.
+ */
+static void wufs_mount_readahead(struct super_block *s)
+{
+  struct wufs_sb_info *sbi = wufs_sb(s);
+  struct buffer_head *bhs[WUFS_MOUNT_RA_MAX];
+  unsigned long block, first[2], last[2];
+  int i, r, n = 0;
+
+  /* the inode map... */
+  first[0] = sbi->sbi_imap_start;
+  last[0] = first[0] + sbi->sbi_imap_bcnt;
+  /* ...and the head of the inode table, which follows the block map */
+  first[1] = sbi->sbi_bmap_start + sbi->sbi_bmap_bcnt;
+  last[1] = min(first[1] + WUFS_MOUNT_ITABLE_RA, sbi->sbi_first_block);
+
+  for (r = 0; r < 2; r++) {
+    for (block = first[r]; block < last[r]; block++) {
+      bhs[n] = sb_getblk(s, block);
+      if (bhs[n]) n++;
+      if (n == WUFS_MOUNT_RA_MAX || (n && block + 1 == last[r])) {
+	/* skips buffers already uptodate; holds its own references on I/O */
+	ll_rw_block(READ, n, bhs);
+	for (i = 0; i < n; i++) brelse(bhs[i]);
+	n = 0;
+      }
+    }
+  }
+}
+
 /**
  * wufs_fill_super:
  * This helper routine fills out the fields of the vfs super_block structure
@@ -216,9 +301,8 @@ static int wufs_get_sb(struct file_system_type *fs_type,
 static int wufs_fill_super(struct super_block *s, void *data, int silent)
 {
   struct buffer_head *bh;
-  struct buffer_head **map;
   struct wufs_super_block *ms;
-  unsigned long i, block;
+  unsigned long blocksize;
   struct inode *root_inode;
   struct wufs_sb_info *sbi;
   int ret = -EINVAL;
@@ -236,8 +320,11 @@ static int wufs_fill_super(struct super_block *s, void *data, int silent)
   /* link it into the vfs superblock */
   s->s_fs_info = sbi;
 
+  if (!parse_options((char *)data, &sbi->sbi_mount_opt)) goto out;
+
   /* Set the optimal transfer size for the device.
-   * Currently, BLOCK_SIZE is 1024 (see fs.h)
+   * Currently, BLOCK_SIZE is 1024 (see fs.h); this is enough to find the
+   * superblock, which may call for a larger size (see below).
    */
   if (!sb_set_blocksize(s, BLOCK_SIZE)) goto out_bad_hblock;
 
@@ -257,15 +344,46 @@ static int wufs_fill_super(struct super_block *s, void *data, int silent)
   sbi->sbi_bmap_bcnt = ms->sb_bmap_bcnt; /* n.b. this maps *all* blocks on disk */
   sbi->sbi_first_block = ms->sb_first_block;
   sbi->sbi_max_fsize = ms->sb_max_fsize;
-  sbi->sbi_max_fblks = (ms->sb_max_fsize+WUFS_BLOCKSIZE-1)/WUFS_BLOCKSIZE;
+  blocksize = BLOCK_SIZE;
   s->s_magic = 0x0fff & ms->sb_magic;
   if (s->s_magic == WUFS_MAGIC) {
     sbi->sbi_version = (ms->sb_magic >> 12) & 0x000f;
     printk("WUFS: Version 0x%x file system detected.\n",sbi->sbi_version);
+    if (sbi->sbi_version > WUFS_VERSION_MAX) goto out_bad_version;
+
+    /* block pointer geometry: version 2 adds double and triple indirection */
+    sbi->sbi_depth = (sbi->sbi_version >= 2) ? WUFS_V2_INDIRECTS : WUFS_V1_INDIRECTS;
+    if (sbi->sbi_version >= 3) {
+      /* version 3 widens block addresses (and so, inodes) to 32 bits */
+      sbi->sbi_blocks = ms->sb_blocks32;
+      sbi->sbi_first_block = ms->sb_first_block32;
+      sbi->sbi_bmap_bcnt = ms->sb_bmap_bcnt32;
+      sbi->sbi_ptrsize = sizeof(__u32);
+      sbi->sbi_inode_size = WUFS_INODE32_SIZE;
+      sbi->sbi_ndirect = WUFS_INODE32_BPTRS - sbi->sbi_depth;
+      sbi->sbi_features = ms->sb_features;
+      if (sbi->sbi_features & ~WUFS_FEATURES_KNOWN) goto out_bad_features;
+      /* blocks may be as large as a page */
+      if (ms->sb_log_block_size > WUFS_MAX_LOG_BLOCK_SIZE) goto out_bad_blocksize;
+      blocksize = BLOCK_SIZE << ms->sb_log_block_size;
+    } else {
+      sbi->sbi_ptrsize = sizeof(__u16);
+      sbi->sbi_inode_size = WUFS_INODESIZE;
+      sbi->sbi_ndirect = WUFS_INODE_BPTRS - sbi->sbi_depth;
+    }
     
     /* you might make the following conditional, based on version: */
     sbi->sbi_dirsize = WUFS_DIRENTSIZE;
     sbi->sbi_namelen = WUFS_NAMELEN;
+    if (wufs_has_feature(s, WUFS_FEATURE_VARDIR)) {
+      /* entries vary in size: sbi_dirsize is that of the smallest */
+      if (wufs_has_feature(s, WUFS_FEATURE_DIR_INDEX)) goto out_bad_dirformat;
+      sbi->sbi_dirsize = WUFS_DIRENT2_SIZE(0);
+      sbi->sbi_namelen = WUFS_NAMELEN2;
+    } else if (wufs_has_feature(s, WUFS_FEATURE_FILETYPE)) {
+      /* the last byte of a classic name holds the file type */
+      sbi->sbi_namelen = WUFS_NAMELEN - 1;
+    }
 
     sbi->sbi_link_max = WUFS_LINK_MAX; /* Maximum number of links to a single file */
   } else {
@@ -275,29 +393,45 @@ static int wufs_fill_super(struct super_block *s, void *data, int silent)
   }
 
   /*
-   * Allocate the inode and disk map buffers.
+   * Switch to the file system's own block size, and find the superblock
+   * again: it is always at byte WUFS_SUPER_OFFSET.
    */
-  if (sbi->sbi_imap_bcnt == 0 || sbi->sbi_bmap_bcnt == 0) goto out_illegal_sb;
-  i = (sbi->sbi_imap_bcnt + sbi->sbi_bmap_bcnt) * sizeof(bh);
-  map = kzalloc(i, GFP_KERNEL);
-  if (!map) goto out_no_map;
-  sbi->sbi_imap = map;
-  sbi->sbi_bmap = map + sbi->sbi_imap_bcnt;
-
-  /* now, begin reading map blocks.  inode map starts at block 2 */
-  block=2;
-  for (i=0; i < sbi->sbi_imap_bcnt; i++) {
-    sbi->sbi_imap[i] = sb_bread(s, block);
-    if (!sbi->sbi_imap[i]) goto out_no_bitmap;
-    block++;
+  if (blocksize != BLOCK_SIZE) {
+    brelse(bh);
+    bh = NULL;
+    if (!sb_set_blocksize(s, blocksize)) goto out_bad_blocksize;
+    if (!(bh = sb_bread(s, WUFS_SUPER_OFFSET / blocksize))) goto out_bad_sb;
+    ms = (struct wufs_super_block *)(bh->b_data + WUFS_SUPER_OFFSET % blocksize);
+    sbi->sbi_ms = ms;
+    sbi->sbi_sbh = bh;
   }
 
-  /* follow with the data block map */
-  for (i=0 ; i < sbi->sbi_bmap_bcnt ; i++) {
-    sbi->sbi_bmap[i] = sb_bread(s, block);
-    if (!sbi->sbi_bmap[i]) goto out_no_bitmap;
-    block++;
-  }
+  /* file sizes are limited by the superblock, and by the block pointers */
+  sbi->sbi_max_fblks = wufs_blocks(sbi->sbi_max_fsize, s);
+  if (!wufs_has_feature(s, WUFS_FEATURE_EXTENTS))
+    sbi->sbi_max_fblks = min(sbi->sbi_max_fblks, wufs_max_blocks(s));
+
+  /*
+   * Locate the inode and disk maps.  Their blocks are not read here: the
+   * routines in bitmap.c read them on demand, through the buffer cache.
+   */
+  if (sbi->sbi_imap_bcnt == 0 || sbi->sbi_bmap_bcnt == 0) goto out_illegal_sb;
+  /* inode map starts just after the superblock (block 2, for 1K blocks) */
+  sbi->sbi_imap_start = WUFS_SUPER_OFFSET / blocksize + 1;
+  sbi->sbi_bmap_start = sbi->sbi_imap_start + sbi->sbi_imap_bcnt;
+
+  /* start reading the inode map and root inode in one batch, not serially */
+  wufs_mount_readahead(s);
+
+  /*
+   * Set up the allocation groups, counting the free inodes (streaming the
+   * inode map); from here on, the allocation routines in bitmap.c keep the
+   * counts current.  Block groups are counted as they are first used (see
+   * wufs_count_free_blocks).
+   */
+  ret = wufs_setup_groups(s);
+  if (ret == -EIO) goto out_no_bitmap;
+  if (ret) goto out_no_groups;
 
   /*
    * We now begin filling out the vfs superblock.
@@ -338,27 +472,41 @@ static int wufs_fill_super(struct super_block *s, void *data, int silent)
  out_iput:
   /* unreference root_inode */
   iput(root_inode);
-  goto out_freemap;
+  goto out_freegroups;
 
  out_no_root:
   if (!silent) printk("WUFS: get root inode failed\n");
-  goto out_freemap;
+
+ out_freegroups:
+  /* release the allocation group table */
+  wufs_destroy_groups(sbi);
+  goto out_release;
+
+ out_no_groups:
+  ret = -ENOMEM;
+  if (!silent) printk("WUFS: can't allocate allocation groups\n");
+  goto out_release;
 
  out_no_bitmap:
   printk("WUFS: bad superblock or unable to read bitmaps\n");
+  goto out_release;
 
- out_freemap:
-  /* release block buffers read from disk that hold bitmaps */
-  for (i = 0; i < sbi->sbi_imap_bcnt; i++)
-    brelse(sbi->sbi_imap[i]);
-  for (i = 0; i < sbi->sbi_bmap_bcnt; i++)
-    brelse(sbi->sbi_bmap[i]);
-  kfree(sbi->sbi_imap);
+ out_bad_blocksize:
+  if (!silent) printk("WUFS: unsupported block size on %s\n", s->s_id);
   goto out_release;
 
- out_no_map:
-  ret = -ENOMEM;
-  if (!silent) printk("WUFS: can't allocate map\n");
+ out_bad_features:
+  if (!silent) printk("WUFS: unsupported features 0x%x\n",
+		      sbi->sbi_features & ~WUFS_FEATURES_KNOWN);
+  goto out_release;
+
+ out_bad_dirformat:
+  if (!silent) printk("WUFS: hashed directories need fixed size entries\n");
+  goto out_release;
+
+ out_bad_version:
+  if (!silent) printk("WUFS: version 0x%x is newer than this driver (0x%x)\n",
+		      sbi->sbi_version, WUFS_VERSION_MAX);
   goto out_release;
 
  out_illegal_sb:
@@ -387,13 +535,40 @@ static int wufs_fill_super(struct super_block *s, void *data, int silent)
   return ret;
 }
 
+/**
+ * parse_options: (utility function)
+ * Apply the comma separated mount options to *opt (WUFS_MOUNT_* bits).
+ * Returns 1 if every option was understood, 0 otherwise.
+ */
+static int parse_options(char *options, unsigned long *opt)
+{
+  substring_t args[MAX_OPT_ARGS];
+  char *p;
+
+  if (!options) return 1;
+  while ((p = strsep(&options, ",")) != NULL) {
+    if (!*p) continue;
+    switch (match_token(p, tokens, args)) {
+    case Opt_dircache:
+      *opt |= WUFS_MOUNT_DIRCACHE;
+      break;
+    case Opt_nodircache:
+      *opt &= ~WUFS_MOUNT_DIRCACHE;
+      break;
+    default:
+      printk("WUFS: unrecognized mount option \"%s\"\n", p);
+      return 0;
+    }
+  }
+  return 1;
+}
+
 /**
  * wufs_put_super:
  * File system is unmounting; free the superblock and associated info.
  */
 static void wufs_put_super(struct super_block *sb)
 {
-  int i;
   struct wufs_sb_info *sbi = wufs_sb(sb);
 
   /* if this filesystem is read/write, we flush back the state in the sb */
@@ -404,19 +579,13 @@ static void wufs_put_super(struct super_block *sb)
     mark_buffer_dirty(sbi->sbi_sbh);
   }
 
-  /* free the blocks used for holding bitmaps (they were marked dirty
-   * (if necessary) in bitmap handling routines
+  /* free the allocation group table (bitmap blocks are not held; they
+   * were marked dirty (if necessary) in bitmap handling routines)
    */
-  for (i = 0; i < sbi->sbi_imap_bcnt; i++)
-    brelse(sbi->sbi_imap[i]);
-  for (i = 0; i < sbi->sbi_bmap_bcnt; i++)
-    brelse(sbi->sbi_bmap[i]);
+  wufs_destroy_groups(sbi);
 
   /* free the superblock header */
   brelse (sbi->sbi_sbh);
-
-  /* free the imap (and bmap; they're together; see above) map block array */
-  kfree(sbi->sbi_imap);
   
   /* unlink the info from the superblock */
   sb->s_fs_info = NULL;
@@ -451,7 +620,8 @@ static struct inode *wufs_iget0(struct inode *inode)
   struct buffer_head *bh;
   struct wufs_inode *raw_inode;
   struct wufs_inode_info *wufs_inode = wufs_i(inode);
-  int i;
+  struct wufs_sb_info *sbi = wufs_sb(inode->i_sb);
+  int i, n;
 
   /* fetch the "raw" inode from the disk; point bh as the buffer used */
   raw_inode = wufs_raw_inode(inode->i_sb, inode->i_ino, &bh);
@@ -482,16 +652,20 @@ static struct inode *wufs_iget0(struct inode *inode)
   /* compute the number of 512-byte blocks used by the file */
   inode->i_blocks = 0;
 
-  /* copy over the data block pointers */
-  for (i = 0; i < WUFS_INODE_BPTRS; i++)
-    wufs_inode->ini_data[i] = raw_inode->in_block[i];
+  /* copy over the data block pointers (32 bit, from version 3) */
+  n = sbi->sbi_ndirect + sbi->sbi_depth;
+  for (i = 0; i < n; i++)
+    wufs_inode->ini_data[i] = (sbi->sbi_version >= 3) ?
+      ((struct wufs_inode32 *)raw_inode)->in_block[i] : raw_inode->in_block[i];
+  for (; i < WUFS_INODE32_BPTRS; i++)
+    wufs_inode->ini_data[i] = 0;
 
   /* now, set the inode operations (based on file/device type)
    * n.b. if this inode is a device (signaled in mode), then the
    * first block pointer is used to store the major & minor device numbers
    * (old_decode_dev: see <linux/kdev_t.h>)
    */
-  wufs_set_inode(inode, old_decode_dev(raw_inode->in_block[0]));
+  wufs_set_inode(inode, old_decode_dev(wufs_inode->ini_data[0]));
 
   /* free raw inode buffer and return */
   brelse(bh);
@@ -537,7 +711,8 @@ static struct buffer_head *wufs_update_inode(struct inode * inode)
   struct buffer_head * bh;
   struct wufs_inode * raw_inode;
   struct wufs_inode_info *wufs_inode = wufs_i(inode);
-  int i;
+  struct wufs_sb_info *sbi = wufs_sb(inode->i_sb);
+  int i, n = sbi->sbi_ndirect + sbi->sbi_depth;
 
   /* fetch the disk version of this inode */
   raw_inode = wufs_raw_inode(inode->i_sb, inode->i_ino, &bh);
@@ -556,12 +731,18 @@ static struct buffer_head *wufs_update_inode(struct inode * inode)
   raw_inode->in_time = inode->i_mtime.tv_sec;
 
   /* nonregular files have the initial block pointer representing device */
-  if (S_ISCHR(inode->i_mode) || S_ISBLK(inode->i_mode))
-    raw_inode->in_block[0] = old_encode_dev(inode->i_rdev);
-  else {
+  if (S_ISCHR(inode->i_mode) || S_ISBLK(inode->i_mode)) {
+    if (sbi->sbi_version >= 3)
+      ((struct wufs_inode32 *)raw_inode)->in_block[0] = old_encode_dev(inode->i_rdev);
+    else
+      raw_inode->in_block[0] = old_encode_dev(inode->i_rdev);
+  } else {
     /* regular and disk files: copy back the block references */
-    for (i = 0; i < WUFS_INODE_BPTRS; i++)
-	 raw_inode->in_block[i] = wufs_inode->ini_data[i];
+    for (i = 0; i < n; i++)
+      if (sbi->sbi_version >= 3)
+	((struct wufs_inode32 *)raw_inode)->in_block[i] = wufs_inode->ini_data[i];
+      else
+	raw_inode->in_block[i] = wufs_inode->ini_data[i];
   }
 
   /* push back the inode data to disk*/
@@ -580,6 +761,15 @@ static struct inode *wufs_alloc_inode(struct super_block *sb)
   /* allocate kernel memory */
   ei = (struct wufs_inode_info *)kmem_cache_alloc(wufs_inode_cachep, GFP_KERNEL);
   if (!ei) return NULL;
+  /* the indirect pointer cache is filled on first use (see indirect.c) */
+  ei->ini_indirect = NULL;
+  /* ...as is a directory's name cache (see dircache.c) */
+  ei->ini_dircache = NULL;
+  /* nothing is known of a directory's free slots (see wufs_add_link) */
+  ei->ini_free_hint = 0;
+  ei->ini_free_count = -1;
+  /* ...or whether it is hashed (see dx_indexed in dir.c) */
+  ei->ini_indexed = -1;
 
   /* return pointer to associated inode */
   return &ei->ini_vfs_inode;
@@ -591,6 +781,8 @@ static struct inode *wufs_alloc_inode(struct super_block *sb)
  */
 static void wufs_destroy_inode(struct inode *inode)
 {
+  kfree(wufs_i(inode)->ini_indirect);
+  wufs_dircache_drop(inode);
   kmem_cache_free(wufs_inode_cachep, wufs_i(inode));
 }
 
@@ -621,6 +813,11 @@ static int wufs_remount (struct super_block * sb, int * flags, char * data)
 {
   struct wufs_sb_info * sbi = wufs_sb(sb);
   struct wufs_super_block * ms;
+  unsigned long opt = sbi->sbi_mount_opt;
+
+  /* options change only if they all make sense */
+  if (!parse_options(data, &opt)) return -EINVAL;
+  sbi->sbi_mount_opt = opt;
 
   /* here's the on-disk superblock */
   ms = sbi->sbi_ms;
@@ -685,12 +882,12 @@ static int wufs_statfs(struct dentry *dentry, struct kstatfs *buf)
   /* get the useful data space */
   buf->f_blocks = sbi->sbi_blocks - sbi->sbi_first_block+1;
 
-  printk("WUFS: statfs reporting %llu blocks available.\n",buf->f_blocks);
-
-  /* get the number of free blocks (see bitmap.c) */
-  buf->f_bfree = wufs_count_free_blocks(sbi);
-  
-  printk("WUFS: reporting %llu free blocks available.\n",buf->f_bfree);
+  /*
+   * get the number of free blocks; this count is maintained by the
+   * allocator (see bitmap.c), and estimated for groups not yet counted,
+   * so no bitmap block is read here
+   */
+  buf->f_bfree = wufs_count_free_blocks(sb);
 
   /* number of these blocks available to normal users (all) */
   buf->f_bavail = buf->f_bfree;
@@ -698,9 +895,8 @@ static int wufs_statfs(struct dentry *dentry, struct kstatfs *buf)
   /* number of file nodes in system */
   buf->f_files = sbi->sbi_inodes;
 
-  /* number of inodes that are free */
-  buf->f_ffree = wufs_count_free_inodes(sbi);
-  printk("WUFS: reporting %llu free inodes available.\n",buf->f_ffree);
+  /* number of inodes that are free (also maintained by bitmap.c) */
+  buf->f_ffree = wufs_count_free_inodes(sb);
 
   /* maximum length of file names on this device */
   buf->f_namelen = sbi->sbi_namelen;
@@ -716,6 +912,18 @@ static int wufs_writepage(struct page *page, struct writeback_control *wbc)
   return block_write_full_page(page, wufs_get_blk, wbc);
 }
 
+/**
+ * wufs_writepages: (address space operation)
+ * Write back a range of dirty pages.
+ * Pages whose blocks are contiguous on disk are gathered into large bios;
+ * any other page (e.g. partly mapped) is handed to wufs_writepage.
+ */
+static int wufs_writepages(struct address_space *mapping,
+			   struct writeback_control *wbc)
+{
+  return mpage_writepages(mapping, wbc, wufs_get_blk);
+}
+
 /**
  * wufs_readpage: (address space operation)
  * Read a page from disk.
@@ -725,6 +933,18 @@ static int wufs_readpage(struct file *file, struct page *page)
   return block_read_full_page(page,wufs_get_blk);
 }
 
+/**
+ * wufs_readpages: (address space operation)
+ * Read a batch of pages (typically, readahead) from disk.
+ * The mpage code asks wufs_get_blk to map runs of blocks, and gathers
+ * pages that are contiguous on disk into large bios.
+ */
+static int wufs_readpages(struct file *file, struct address_space *mapping,
+			  struct list_head *pages, unsigned nr_pages)
+{
+  return mpage_readpages(mapping, pages, nr_pages, wufs_get_blk);
+}
+
 /**
  * wufs_write_begin: (address space operation)
  * Prepare for an upcoming write -- perhaps by fetching adjacent blocks
@@ -759,6 +979,25 @@ static sector_t wufs_bmap(struct address_space *mapping, sector_t block)
   return generic_block_bmap(mapping,block,wufs_get_blk);
 }
 
+/**
+ * wufs_direct_IO: (address space operation)
+ * Transfer data for an O_DIRECT file directly between user memory and
+ * the disk, bypassing the page cache.  Blocks are mapped (and, on writes
+ * beyond the end of file, allocated) by wufs_get_blk.  The generic code
+ * rejects transfers not aligned to the device's sector size, and falls
+ * back to buffered writes for whatever a direct write leaves undone.
+ */
+static ssize_t wufs_direct_IO(int rw, struct kiocb *iocb,
+			      const struct iovec *iov,
+			      loff_t offset, unsigned long nr_segs)
+{
+  struct file *file = iocb->ki_filp;
+  struct inode *inode = file->f_mapping->host;
+
+  return blockdev_direct_IO(rw, iocb, inode, inode->i_sb->s_bdev, iov,
+			    offset, nr_segs, wufs_get_blk, NULL);
+}
+
 /**
  * wufs_set_inode:
  * Set the operations for the particular inode based on the type of file.
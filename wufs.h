@@ -11,6 +11,8 @@
 #define FS_WUFS_H
 #include <linux/fs.h>
 #include <linux/pagemap.h>
+#include <linux/percpu_counter.h>
+#include <linux/rwsem.h>
 #include "wufs_fs.h"
 
 /**
@@ -18,10 +20,40 @@
  * wufs fs inode data in memory
  */
 struct wufs_inode_info {
-  __u16        ini_data[WUFS_INODE_BPTRS];
+  __u32        ini_data[WUFS_INODE32_BPTRS]; /* block pointers (32 bit) */
+  rwlock_t     ini_pointers_lock; /* protects block pointer updates */
+  struct rw_semaphore ini_extent_sem; /* protects the extent tree (extent.c) */
+  __u32       *ini_indirect;	/* cached leaf indirect block (or NULL) */
+  unsigned long ini_indirect_base; /* first file block mapped by cached leaf */
+  unsigned long ini_indirect_lba;  /* lba of cached leaf */
+  struct wufs_dircache *ini_dircache; /* directory name cache (dircache.c) */
+  loff_t       ini_free_hint;	/* (directory) no free dirent lies before */
+  long         ini_free_count;	/* (directory) free dirents, or -1: unknown */
+  int          ini_indexed;	/* (directory) hashed: 1, 0, or -1: unknown */
   struct inode ini_vfs_inode;
 };
 
+/**
+ * wufs_group_info:
+ * In-memory state of an allocation group: the blocks mapped by one block
+ * of the block bitmap, or the WUFS_IGROUP_BITS inodes mapped by part of a
+ * block of the inode map.  Each group is locked independently, so
+ * allocators working in different groups do not contend.
+ */
+struct wufs_group_info {
+  spinlock_t    gri_lock;	/* protects this group's bits of the map */
+  unsigned long gri_free;	/* count of free blocks (inodes) in group */
+  unsigned long gri_rotor;	/* lba (inode index) where next search begins */
+  int           gri_counted;	/* gri_free is valid (census taken) */
+} ____cacheline_aligned_in_smp;
+
+/*
+ * Inodes per inode allocation group: a multiple of the bits in a long (so
+ * groups never share a word of the map) that divides the bits in any map
+ * block (so groups never span map blocks).
+ */
+#define WUFS_IGROUP_BITS 1024
+
 /*
  * associated wufs super-block data in memory
  */
@@ -32,20 +64,38 @@ struct wufs_sb_info {
   unsigned long        sbi_first_block; /* first data block lba */
   unsigned long        sbi_inodes;	/* count of inodes */
   unsigned long        sbi_imap_bcnt;	/* block count of inode map */
-  struct buffer_head **sbi_imap;	/* pointer to blocks of inode map */
+  unsigned long        sbi_imap_start;	/* lba of first block of inode map */
   unsigned long        sbi_bmap_bcnt;   /* block count of block map */
-  struct buffer_head **sbi_bmap;        /* pointer to blocks of block map */
+  unsigned long        sbi_bmap_start;  /* lba of first block of block map */
+
+  /* block allocation groups, one per bmap block (see bitmap.c) */
+  struct wufs_group_info *sbi_groups;
+  struct percpu_counter   sbi_free_blocks; /* zero bits in counted groups */
+  atomic_t                sbi_uncounted;   /* groups with no census yet */
+  unsigned long           sbi_census;      /* where census_step looks next */
+
+  /* inode allocation groups, WUFS_IGROUP_BITS inodes each (see bitmap.c) */
+  struct wufs_group_info *sbi_igroups;
+  unsigned long           sbi_igroup_cnt;
+  struct percpu_counter   sbi_free_inodes; /* count of zero bits in imap */
 
   /* WUFS inode information */
   unsigned int sbi_version;	/* version number (high nibble of magic) */
+  int           sbi_ndirect;	/* count of direct block pointers in inode */
+  int           sbi_depth;	/* count of indirect trees (deepest level) */
+  int           sbi_ptrsize;	/* bytes per on-disk block pointer (2 or 4) */
+  int           sbi_inode_size;	/* bytes per on-disk inode */
+  __u32         sbi_features;	/* optional features (WUFS_FEATURE_*) */
   unsigned long sbi_max_fsize;	/* maximum file size, on this file system */
   unsigned long sbi_max_fblks;	/* maximum file size (blocks), on this file system */
   int           sbi_link_max;	/* maximum number of links (silly) */
 
   /* WUFS dirent information */
-  int sbi_dirsize;	/* size of directory entries */
+  int sbi_dirsize;	/* size of directory entries (vardir: smallest) */
   int sbi_namelen;	/* limit on file name length */
 
+  unsigned long sbi_mount_opt;	/* mount options (WUFS_MOUNT_*) */
+
   /* slab pointers to cached superblock */
   struct buffer_head      *sbi_sbh;	/* pointer to buffer head for super */
   struct wufs_super_block *sbi_ms;	/* above, cast as a superblock ptr */
@@ -60,14 +110,29 @@ struct wufs_sb_info {
  */
 extern void               wufs_free_block(struct inode *inode,
 					  unsigned long block);
-extern int                wufs_new_block(struct inode * inode);
-extern unsigned long      wufs_count_free_blocks(struct wufs_sb_info *sbi);
+extern void               wufs_free_blocks(struct inode *inode,
+					   unsigned long block,
+					   unsigned long count);
+extern unsigned long      wufs_new_block(struct inode * inode,
+					 unsigned long goal);
+extern unsigned long      wufs_new_blocks(struct inode *inode,
+					  unsigned long goal,
+					  unsigned long minlen, unsigned long maxlen,
+					  unsigned long *count);
+extern int                wufs_setup_groups(struct super_block *sb);
+extern void               wufs_destroy_groups(struct wufs_sb_info *sbi);
 extern void               wufs_free_inode(struct inode * inode);
 extern struct wufs_inode *wufs_raw_inode(struct super_block *, ino_t,
 					    struct buffer_head **);
 extern struct inode      *wufs_new_inode(const struct inode * dir,
 					 int * error);
-extern unsigned long      wufs_count_free_inodes(struct wufs_sb_info *sbi);
+extern unsigned long      wufs_count_free_blocks(struct super_block *sb);
+extern unsigned long      wufs_count_free_inodes(struct super_block *sb);
+
+/*
+ * Mount options (sbi_mount_opt)
+ */
+#define WUFS_MOUNT_DIRCACHE	0x0001	/* cache names of linear directories */
 
 /*
  * From dir.c
@@ -105,6 +170,25 @@ extern void		      wufs_truncate(struct inode *);
 extern int                    wufs_get_blk(struct inode *, sector_t,
 					struct buffer_head *, int);
 extern unsigned               wufs_blocks(loff_t, struct super_block *);
+extern unsigned long          wufs_max_blocks(struct super_block *);
+
+/*
+ * From extent.c:
+ */
+extern int  wufs_extent_get_blk(struct inode *, sector_t,
+				struct buffer_head *, int);
+extern void wufs_extent_truncate(struct inode *);
+
+/*
+ * From dircache.c:
+ */
+extern int  wufs_dircache_add(struct inode *, const char *, int, loff_t);
+extern void wufs_dircache_drop(struct inode *);
+extern void wufs_dircache_exit(void);
+extern int  wufs_dircache_init(void);
+extern int  wufs_dircache_lookup(struct inode *, const char *, int, loff_t *);
+extern int  wufs_dircache_new(struct inode *, unsigned long);
+extern void wufs_dircache_remove(struct inode *, const char *, int);
 
 /*
  * Shared structures: class vtables.
@@ -128,4 +212,22 @@ static inline struct wufs_inode_info *wufs_i(struct inode *inode)
   return list_entry(inode, struct wufs_inode_info, ini_vfs_inode);
 }
 
+/*
+ * wufs_has_feature:
+ * Whether the file system has the optional feature(s) f (WUFS_FEATURE_*).
+ */
+static inline int wufs_has_feature(struct super_block *sb, __u32 f)
+{
+  return (wufs_sb(sb)->sbi_features & f) != 0;
+}
+
+/*
+ * wufs_test_opt:
+ * Whether the file system was mounted with option(s) o (WUFS_MOUNT_*).
+ */
+static inline int wufs_test_opt(struct super_block *sb, unsigned long o)
+{
+  return (wufs_sb(sb)->sbi_mount_opt & o) != 0;
+}
+
 #endif /* FS_WUFS_H */
@@ -17,15 +17,24 @@
  */
 #define WUFS_MAGIC	0x0EEF  /* We are BEEF. Moo.*/
 #define VERSION_MAGIC   0x1EEF  /* We are BEEF. Moo.*/
+#define VERSION2_MAGIC  0x2EEF  /* adds double and triple indirect blocks */
+#define VERSION3_MAGIC  0x3EEF  /* adds 32 bit block addresses */
+#define WUFS_VERSION_MAX 3	/* newest version (high nibble) understood */
 /*
  * the WUFS_BLOCKSIZE should be a multiple of the BLOCK_SIZE found in fs.h
- * Currently, that's 1024, so we're cool.  Later, we may have to bump this
- * up, but it will make small devices inefficent:
+ * Currently, that's 1024, so we're cool.  From version 3, larger blocks
+ * (up to a 4K page) may be chosen when formatting (see sb_log_block_size);
+ * this makes small devices inefficent:
  *   - wasted space in boot and super blocks
  *   - (wildly) excessive bitmap over allocation for small devices
  *   - general internal fragmentation in files (see Berkeley's ffs for sol'ns)
+ * but gives one buffer per page, and more reach per indirect block.
+ * Whatever the block size, the superblock is found at byte WUFS_SUPER_OFFSET,
+ * and the inode map begins in the block that follows it.
  */
-#define WUFS_BLOCKSIZE	1024 	/* size of file system's logical blocks */
+#define WUFS_BLOCKSIZE	1024 	/* size of file system's logical blocks (v < 3) */
+#define WUFS_MAX_LOG_BLOCK_SIZE 2	/* largest blocks: 1024 << 2 */
+#define WUFS_SUPER_OFFSET 1024	/* byte offset of the superblock */
 
 /*
  * The wufs cleanliness bits.
@@ -33,12 +42,28 @@
 #define WUFS_VALID_FS		0x0001		/* a clean machine */
 #define WUFS_ERROR_FS		0x0002		/* wufs with errors */
 
+/*
+ * Optional features (sb_features; version 3 and later).
+ * A file system with features this driver does not know is not mounted.
+ * Note: with FILETYPE but not VARDIR, the type takes the last byte of a
+ * classic entry's name field, so names there are at most WUFS_NAMELEN-1
+ * (29) bytes long, not WUFS_NAMELEN (30).
+ */
+#define WUFS_FEATURE_EXTENTS	0x0001		/* files mapped by extents */
+#define WUFS_FEATURE_DIR_INDEX	0x0002		/* directories hashed by name */
+#define WUFS_FEATURE_VARDIR	0x0004		/* variable length dirents */
+#define WUFS_FEATURE_FILETYPE	0x0008		/* dirents record file type */
+#define WUFS_FEATURES_KNOWN	(WUFS_FEATURE_EXTENTS|WUFS_FEATURE_DIR_INDEX|\
+				 WUFS_FEATURE_VARDIR|WUFS_FEATURE_FILETYPE)
+
 /**
  * wufs_super_block:
  * WUFS super-block data on disk (logical block 1).
  * Notes:
- *  - no support for versions; perhaps high nibble of magic
+ *  - the version is the high nibble of magic
  *  - block bitmap includes *all* blocks on disk, not just data
+ *  - from version 3, the 32 bit fields (following sb_max_fsize) supersede
+ *    the block counts and addresses of the same name
  */
 struct wufs_super_block {
   __u16 sb_magic;		/* unique identifier for WUFS version */
@@ -49,6 +74,12 @@ struct wufs_super_block {
   __u16 sb_imap_bcnt;		/* the size (in blocks) of the imap */
   __u16 sb_bmap_bcnt;		/* the size (in blocks) of the bmap */
   __u32 sb_max_fsize;		/* the maximum file size. u32 to support >64k files */
+  /* version 3 and later: */
+  __u32 sb_blocks32;		/* count of disk blocks */
+  __u32 sb_first_block32;	/* block number of the first data block */
+  __u32 sb_bmap_bcnt32;		/* the size (in blocks) of the bmap */
+  __u32 sb_features;		/* optional features (WUFS_FEATURE_*) */
+  __u32 sb_log_block_size;	/* block size is WUFS_BLOCKSIZE << this */
   //char *secret_message = "SSSH DON'T TELL DUANE ABOUT THIS VERY SECRET MESSAGE";
 };
 
@@ -58,15 +89,23 @@ struct wufs_super_block {
  * Notes:
  *   - size of nlinks is sufficient, but not necessary.
  *   - location of the u32 field arranged on u32 boundary to avoid padding
- *   - all pointers are direct except for the last
+ *   - through version 1, all pointers are direct except for the last,
+ *     which is single indirect
+ *   - from version 2, the last three pointers are single, double, and
+ *     triple indirect
  *   - time is taken to be last modification time
  */
 #define WUFS_LINK_MAX	        255
 #define WUFS_INODE_BPTRS 8 //to compensate for the u32 size
 #define WUFS_INODESIZE   32
-#define WUFS_INODES_PER_BLOCK (WUFS_BLOCKSIZE/WUFS_INODESIZE)
+#define WUFS_INODES_PER_BLOCK(bs) ((bs)/WUFS_INODESIZE)
 #define WUFS_ROOT_INODE 1 /* asserted lba of root directory's inode */
-#define WUFS_SINGLE_INDIRECT_BPTRS (WUFS_BLOCKSIZE/2) //2 byte addresses, single indirect block
+#define WUFS_SINGLE_INDIRECT_BPTRS(bs) ((bs)/2) //2 byte addresses, single indirect block
+#define WUFS_INODE32_BPTRS 12 /* (version 3 and later) */
+#define WUFS_INODE32_SIZE  64
+#define WUFS_V1_INDIRECTS 1	/* count of indirect pointers, version 1 */
+#define WUFS_V2_INDIRECTS 3	/* count of indirect pointers, version 2 */
+#define WUFS_MAX_DEPTH    3	/* deepest indirection supported */
 
 struct wufs_inode {
   __u16 in_mode;		/* file mode */
@@ -80,6 +119,51 @@ struct wufs_inode {
   /* block logically fills to WUFS_INODESIZE (see below) */
 };
 
+/*
+ * wufs_inode32:
+ * The on-disk format of WUFS inodes from version 3.
+ * Notes:
+ *   - same as wufs_inode, but with (more) 32 bit block pointers
+ *   - the last three pointers are single, double, and triple indirect;
+ *     indirect blocks, too, hold 32 bit pointers
+ */
+struct wufs_inode32 {
+  __u16 in_mode;		/* file mode */
+  __u16 in_nlinks;		/* number of links */
+  __u16 in_uid;			/* user id */
+  __u16 in_gid;			/* group id */
+  __u32 in_time;		/* file modification time */
+  __u32 in_size;		/* file size (bytes) */
+  __u32 in_block[WUFS_INODE32_BPTRS]; /* index of data blocks */
+};
+
+/*
+ * wufs_extent_header, wufs_extent:
+ * With the extents feature, the block pointer area of each (wufs_inode32)
+ * inode instead holds the root of a file's extent tree: a header, then
+ * WUFS_INODE_EXTENTS entries.  At depth 0 the entries are extents, each
+ * mapping a run of file blocks to a run of disk blocks.  At greater depths
+ * they index extent blocks (ex_lblk is the first file block the extent
+ * block covers, and ex_start its lba); each extent block holds a header
+ * (with its own depth, one less than its parent's) and as many entries as
+ * fit.  Entries are kept in file block order.  A tree of depth
+ * WUFS_EXTENT_DEPTH_MAX can hold an extent for every block of the largest
+ * file, even with 1K blocks.
+ */
+#define WUFS_INODE_EXTENTS 3
+#define WUFS_EXTENT_DEPTH_MAX 5
+
+struct wufs_extent_header {
+  __u16 eh_entries;		/* count of entries in use */
+  __u16 eh_depth;		/* 0: entries are extents; else they index */
+};
+
+struct wufs_extent {
+  __u32 ex_lblk;		/* first file block mapped */
+  __u32 ex_start;		/* first disk block (or, in an index, lba) */
+  __u32 ex_len;			/* count of blocks (unused in an index) */
+};
+
 /*
  * wufs_dir_entry:
  * Notes:
@@ -89,10 +173,86 @@ struct wufs_inode {
  */
 #define WUFS_NAMELEN 30 // changed to 30
 #define WUFS_DIRENTSIZE	32
-#define WUFS_DIRENTS_PER_BLOCK (WUFS_BLOCKSIZE/WUFS_DIRENTSIZE)
+#define WUFS_DIRENTS_PER_BLOCK(bs) ((bs)/WUFS_DIRENTSIZE)
 
 struct wufs_dirent {
   __u16 de_ino;			/* inode of entry */
   char  de_name[WUFS_NAMELEN];	/* name of directory file (strncpy-able) */
 };
+
+/*
+ * With the filetype feature, each entry records the type of the file it
+ * names, so readdir can report it without reading the inode.  A classic
+ * entry keeps the type in the last byte of de_name (names are then at most
+ * WUFS_NAMELEN-1 bytes); a variable length entry keeps it in de_file_type.
+ */
+#define WUFS_FT_UNKNOWN		0
+#define WUFS_FT_REG_FILE	1
+#define WUFS_FT_DIR		2
+#define WUFS_FT_CHRDEV		3
+#define WUFS_FT_BLKDEV		4
+#define WUFS_FT_FIFO		5
+#define WUFS_FT_SOCK		6
+#define WUFS_FT_SYMLINK		7
+#define WUFS_FT_MAX		8
+
+/*
+ * wufs_dirent2:
+ * With the vardir feature, directory entries instead vary in length, so
+ * short names pack densely and long names fit.  Each block of a directory
+ * is exactly covered by entries (entries never span blocks).  de_rec_len
+ * covers the entry's name (padded to a multiple of WUFS_DIRENT2_ROUND
+ * bytes) and any free space that follows it; the last entry of a block
+ * reaches to its end.  Removing an entry folds it into the entry before
+ * it, or (if first in its block) just sets de_ino to 0.
+ * The hashed directory index assumes classic entries: dir_index and vardir
+ * may not be used together.
+ */
+#define WUFS_NAMELEN2 255
+#define WUFS_DIRENT2_ROUND 4
+#define WUFS_DIRENT2_SIZE(len) \
+  ((8 + (len) + WUFS_DIRENT2_ROUND - 1) & ~(WUFS_DIRENT2_ROUND - 1))
+
+struct wufs_dirent2 {
+  __u32 de_ino;			/* inode of entry (0: unused) */
+  __u16 de_rec_len;		/* bytes to the next entry */
+  __u8  de_name_len;		/* length of name */
+  __u8  de_file_type;		/* WUFS_FT_* (filetype feature), or 0 */
+  char  de_name[WUFS_NAMELEN2];	/* name (not null terminated) */
+};
+
+/*
+ * wufs_dx_head, wufs_dx_entry:
+ * With the dir_index feature, directories made by the driver are hashed.
+ * Block 0 (the root) holds "." and "..", then a head in the third dirent
+ * slot, then an array of index entries; each entry maps the names whose
+ * hash is at least dx_hash (and less than the next entry's) to the leaf at
+ * file block dx_block.  The first entry's hash is always 0.  Leaves are
+ * ordinary blocks of dirents.  When the root fills, its entries move to an
+ * index node (a block with a head in its first slot, then entries), and
+ * the root indexes nodes instead.  A head looks like an unused dirent
+ * (de_ino and de_name[0] are zero); readers skip the rest of its block.
+ * Name hashes are even: an entry whose hash has the low bit set
+ * (WUFS_DX_CONTINUED) marks a leaf that holds more names with the hash of
+ * the leaf before it, when there were too many to fit in one.
+ */
+#define WUFS_DX_MAGIC 0xd1
+#define WUFS_DX_CONTINUED 1
+#define WUFS_DX_LEVELS_MAX 1
+
+struct wufs_dx_head {
+  __u16 dh_ino;			/* always 0 */
+  __u8  dh_zero;		/* always 0 */
+  __u8  dh_magic;		/* WUFS_DX_MAGIC */
+  __u8  dh_levels;		/* (root only) levels of nodes below the root */
+  __u8  dh_unused;
+  __u16 dh_count;		/* count of entries in use */
+  __u16 dh_limit;		/* count of entries that fit in the block */
+  char  dh_pad[WUFS_DIRENTSIZE-10];
+};
+
+struct wufs_dx_entry {
+  __u32 dx_hash;		/* least name hash mapped to this block */
+  __u32 dx_block;		/* file block number of leaf (or node) */
+};
 #endif /* WUFS_FS_H */